@@ -1,80 +1,432 @@
 #include <arch/i386/pmm.h>
+#include <arch/i386/vmm.h>
 #include <kernel/multiboot.h>
+#include <kernel/log.h>
+#include <kernel/sync.h>
+#include <arch/i386/time.h>
+#include <libc/strings.h>
 
 // We will use a static bitmap to track memory usage.
 // The location and size will be determined by pmm_init.
 static kuint32_t *memory_map = 0;
 static kuint32_t max_blocks = 0;
 static kuint32_t used_blocks = 0;
+static kuint32_t bitmap_entries = 0;
+
+// The summary has one bit per bitmap entry, set while that entry still has at least one free block.
+// Allocation starts scanning the summary at a rotating cursor instead of at the first entry.
+static kuint32_t *memory_map_summary = 0;
+static kuint32_t summary_entries = 0;
+
+// One descriptor per frame, placed after the summary. The PMM reaches it through its physical address until
+// the VMM maps it into the kernel window and hands us the new pointer.
+static pmm_page_t *page_array = 0;
+static physical_addr_t page_array_start = 0;
+static size_t page_array_size = 0;
+
+// Each zone owns a range of bitmap entries with its own cursor and free count. Zone boundaries fall on 4MB,
+// so every summary word belongs to exactly one zone.
+typedef struct {
+    kuint32_t start_entry, end_entry;
+    kuint32_t next_free_entry;
+    kuint32_t total_blocks;
+    kuint32_t free_blocks;
+} pmm_zone_state_t;
+
+static pmm_zone_state_t pmm_zones[PMM_ZONE_COUNT];
+static const kuint32_t pmm_zone_limits[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA] = PMM_ZONE_DMA_END / PMM_BLOCK_SIZE,
+    [PMM_ZONE_NORMAL] = PMM_ZONE_NORMAL_END / PMM_BLOCK_SIZE,
+    [PMM_ZONE_HIGH] = PMM_FRAMES_BELOW_4G,
+    [PMM_ZONE_HIGH64] = 0xFFFFFFFF,
+};
+
+// The buddy allocator tracks each block of its arena with a node. Free blocks are kept on a doubly linked
+// list per order, linked by arena index, so that a buddy can be unlinked in O(1) when merging. Only the first
+// node of a block carries its order, the nodes inside a block hold PMM_BUDDY_NO_ORDER.
+typedef struct {
+    kuint32_t next;
+    kuint32_t prev;
+    kuint8_t order;
+    kuint8_t free;
+} pmm_buddy_node_t;
+
+static pmm_buddy_node_t buddy_nodes[PMM_BUDDY_ARENA_MAX_BLOCKS];
+static kuint32_t buddy_free_list[PMM_BUDDY_MAX_ORDER + 1];
+static kuint32_t buddy_free_count[PMM_BUDDY_MAX_ORDER + 1];
+static physical_addr_t buddy_arena_start = 0;
+static kuint32_t buddy_arena_blocks = 0;
+static pmm_zone_t buddy_arena_zone = PMM_ZONE_NORMAL;
+
+// Each CPU keeps a small LIFO magazine of free blocks per zone in front of the bitmap. Allocations and frees
+// only touch the shared bitmap (and its lock) to refill or drain a whole batch at a time.
+typedef struct {
+    kuint32_t frames[PMM_MAGAZINE_SIZE];
+    kuint32_t count;
+    kuint32_t hits, misses;
+    kuint32_t refills, drains;
+} pmm_magazine_t;
+
+static pmm_magazine_t pmm_magazines[PMM_MAX_CPUS][PMM_ZONE_COUNT];
+static spinlock_t pmm_lock = SPINLOCK_UNLOCKED;
+
+// Zeroed frames waiting to be handed out, filled from the idle task.
+typedef struct {
+    kuint32_t frames[PMM_ZERO_POOL_SIZE];
+    kuint32_t count;
+    kuint32_t hits, misses;
+} pmm_zero_pool_t;
+
+static pmm_zero_pool_t pmm_zero_pool;
+
+// We only bring up the boot processor for now
+static inline kuint32_t pmm_cpu_id() {
+    return 0;
+}
 
 // These are defined in linker.ld
 extern physical_addr_t _kernel_start;
 extern physical_addr_t _kernel_end;
 
-// Helper function to set a bit in the bitmap.
+// Helper function to set a bit in the bitmap. When its entry fills up, the entry is dropped from the summary.
 static void pmm_set_bit(kuint32_t bit) {
-    memory_map[bit / PMM_BITS_PER_ENTRY] |= (1 << (bit % PMM_BITS_PER_ENTRY));
+    kuint32_t entry = bit / PMM_BITS_PER_ENTRY;
+    memory_map[entry] |= (1 << (bit % PMM_BITS_PER_ENTRY));
+    if (memory_map[entry] == PMM_ENTRY_FULL) {
+        memory_map_summary[entry / PMM_BITS_PER_ENTRY] &= ~(1 << (entry % PMM_BITS_PER_ENTRY));
+    }
 }
 
-// Helper function to clear a bit in the bitmap.
+// Helper function to clear a bit in the bitmap. Its entry now has a free block, so mark it in the summary.
 static void pmm_clear_bit(kuint32_t bit) {
-    memory_map[bit / PMM_BITS_PER_ENTRY] &= ~(1 << (bit % PMM_BITS_PER_ENTRY));
+    kuint32_t entry = bit / PMM_BITS_PER_ENTRY;
+    memory_map[entry] &= ~(1 << (bit % PMM_BITS_PER_ENTRY));
+    memory_map_summary[entry / PMM_BITS_PER_ENTRY] |= (1 << (entry % PMM_BITS_PER_ENTRY));
 }
 
-// Helper function to test if a bit is set.
-static bool pmm_test_bit(kuint32_t bit) {
-    return memory_map[bit / PMM_BITS_PER_ENTRY] & (1 << (bit % PMM_BITS_PER_ENTRY));
+// Recomputes the whole summary from the bitmap, used after the bitmap has been written directly.
+static void pmm_rebuild_summary() {
+    for (kuint32_t i = 0; i < summary_entries; i++) {
+        memory_map_summary[i] = 0;
+    }
+    for (kuint32_t i = 0; i < bitmap_entries; i++) {
+        if (memory_map[i] != PMM_ENTRY_FULL) {
+            memory_map_summary[i / PMM_BITS_PER_ENTRY] |= (1 << (i % PMM_BITS_PER_ENTRY));
+        }
+    }
 }
 
-// Helper to find the first free block of memory and returns its index.
-static kint32_t pmm_find_first_free() {
-    for (kuint32_t i = 0; i < max_blocks / PMM_BITS_PER_ENTRY; i++) {
-        // If the dword is all 1's, there are no free blocks in this chunk.
-        if (memory_map[i] != PMM_ENTRY_FULL) {
-            // Use the bit index to find exactly which of the 32 memory blocks represented by that integer is the first one that's free
-            for (kuint32_t j = 0; j < PMM_BITS_PER_ENTRY; j++) {
-                kuint32_t bit = 1 << j;
-                if (!(memory_map[i] & bit)) {
-                    return i * PMM_BITS_PER_ENTRY + j;
-                }
+// Returns the mask of the bits of a bitmap entry that fall inside the block range [first, end).
+static kuint32_t pmm_entry_mask(kuint32_t entry, kuint32_t first, kuint32_t end) {
+    kuint32_t mask = PMM_ENTRY_FULL;
+    if (entry == first / PMM_BITS_PER_ENTRY) {
+        mask &= PMM_ENTRY_FULL << (first % PMM_BITS_PER_ENTRY);
+    }
+    if (entry == (end - 1) / PMM_BITS_PER_ENTRY) {
+        mask &= PMM_ENTRY_FULL >> (PMM_BITS_PER_ENTRY - 1 - (end - 1) % PMM_BITS_PER_ENTRY);
+    }
+    return mask;
+}
+
+// Marks the blocks in [first, end) as used or free. Whole entries inside the range are written with a
+// single memset and only the entries at its edges need a mask. The summary is left alone.
+static void pmm_mark_range(kuint32_t first, kuint32_t end, bool used) {
+    if (first >= end) {
+        return;
+    }
+
+    kuint32_t first_entry = first / PMM_BITS_PER_ENTRY;
+    kuint32_t last_entry = (end - 1) / PMM_BITS_PER_ENTRY;
+    kuint32_t edges[2] = { first_entry, last_entry };
+    for (kuint32_t i = 0; i < 2; i++) {
+        kuint32_t mask = pmm_entry_mask(edges[i], first, end);
+        if (used) {
+            memory_map[edges[i]] |= mask;
+        } else {
+            memory_map[edges[i]] &= ~mask;
+        }
+    }
+
+    if (last_entry > first_entry + 1) {
+        memset(&memory_map[first_entry + 1], used ? 0xFF : 0, (last_entry - first_entry - 1) * sizeof(kuint32_t));
+    }
+}
+
+// Counts the used blocks in [first, end) an entry at a time.
+static kuint32_t pmm_count_used(kuint32_t first, kuint32_t end) {
+    if (first >= end) {
+        return 0;
+    }
+
+    kuint32_t used = 0;
+    for (kuint32_t entry = first / PMM_BITS_PER_ENTRY; entry <= (end - 1) / PMM_BITS_PER_ENTRY; entry++) {
+        used += __builtin_popcount(memory_map[entry] & pmm_entry_mask(entry, first, end));
+    }
+    return used;
+}
+
+// Helper to find the first bitmap entry in [from, to) that still has a free block. The summary lets
+// us skip 32 full entries (1024 blocks) per word tested.
+static kint32_t pmm_find_free_entry(kuint32_t from, kuint32_t to) {
+    if (from >= to) {
+        return PMM_NO_FREE_BLOCKS;
+    }
+
+    kuint32_t s = from / PMM_BITS_PER_ENTRY;
+    kuint32_t last = (to - 1) / PMM_BITS_PER_ENTRY;
+    kuint32_t bits = memory_map_summary[s] & (PMM_ENTRY_FULL << (from % PMM_BITS_PER_ENTRY));
+    while (!bits) {
+        if (++s > last) {
+            return PMM_NO_FREE_BLOCKS;
+        }
+        bits = memory_map_summary[s];
+    }
+
+    kuint32_t entry = s * PMM_BITS_PER_ENTRY + __builtin_ctz(bits);
+    return entry < to ? (kint32_t)entry : PMM_NO_FREE_BLOCKS;
+}
+
+// Helper to find the next free block of a zone and returns its index. The search resumes at the zone's cursor
+// left by the previous allocation and wraps around once, so the cost no longer grows with the memory in use.
+static kint32_t pmm_find_first_free(pmm_zone_state_t *zone) {
+    kint32_t entry = pmm_find_free_entry(zone->next_free_entry, zone->end_entry);
+    if (entry == PMM_NO_FREE_BLOCKS) {
+        entry = pmm_find_free_entry(zone->start_entry, zone->next_free_entry);
+    }
+    if (entry == PMM_NO_FREE_BLOCKS) {
+        return PMM_NO_FREE_BLOCKS; // No free blocks found
+    }
+
+    // The entry may still have more free blocks, so keep the cursor on it
+    zone->next_free_entry = entry;
+    return entry * PMM_BITS_PER_ENTRY + __builtin_ctz(~memory_map[entry]);
+}
+
+// Returns the zone a frame belongs to.
+static pmm_zone_t pmm_zone_of(kuint32_t frame) {
+    pmm_zone_t zone = PMM_ZONE_DMA;
+    while (frame >= pmm_zone_limits[zone]) {
+        zone++;
+    }
+    return zone;
+}
+
+// Splits the bitmap into zones and counts the free blocks of each.
+static void pmm_zones_init() {
+    kuint32_t zone_start = 0;
+    for (kuint32_t z = 0; z < PMM_ZONE_COUNT; z++) {
+        kuint32_t zone_end = pmm_zone_limits[z];
+        if (zone_end > max_blocks) {
+            zone_end = max_blocks;
+        }
+        if (zone_end < zone_start) {
+            zone_end = zone_start;
+        }
+
+        pmm_zone_state_t *zone = &pmm_zones[z];
+        zone->start_entry = zone_start / PMM_BITS_PER_ENTRY;
+        zone->end_entry = (zone_end + PMM_BITS_PER_ENTRY - 1) / PMM_BITS_PER_ENTRY;
+        zone->next_free_entry = zone->start_entry;
+        zone->total_blocks = zone_end - zone_start;
+        zone->free_blocks = zone->total_blocks - pmm_count_used(zone_start, zone_end);
+        zone_start = zone_end;
+    }
+}
+
+// Pushes an arena block onto the free list for the given order.
+static void pmm_buddy_push(kuint32_t idx, kuint32_t order) {
+    pmm_buddy_node_t *node = &buddy_nodes[idx];
+    node->order = order;
+    node->free = true;
+    node->prev = PMM_BUDDY_NONE;
+    node->next = buddy_free_list[order];
+    if (node->next != PMM_BUDDY_NONE) {
+        buddy_nodes[node->next].prev = idx;
+    }
+    buddy_free_list[order] = idx;
+    buddy_free_count[order]++;
+}
+
+// Unlinks an arena block from the free list of its order.
+static void pmm_buddy_unlink(kuint32_t idx) {
+    pmm_buddy_node_t *node = &buddy_nodes[idx];
+    if (node->prev != PMM_BUDDY_NONE) {
+        buddy_nodes[node->prev].next = node->next;
+    } else {
+        buddy_free_list[node->order] = node->next;
+    }
+    if (node->next != PMM_BUDDY_NONE) {
+        buddy_nodes[node->next].prev = node->prev;
+    }
+    node->free = false;
+    buddy_free_count[node->order]--;
+}
+
+// Looks for the first run of fully free, 4MB aligned chunks (a chunk is 32 bitmap words) starting at the given
+// chunk, up to 'limit' chunks long. Returns the length of the run and its first chunk.
+static kuint32_t pmm_buddy_find_run(kuint32_t from_chunk, kuint32_t limit, kuint32_t *first_chunk) {
+    kuint32_t words_per_chunk = PMM_BUDDY_CHUNK_BLOCKS / PMM_BITS_PER_ENTRY;
+
+    // The buddy hands out blocks by address, so the arena has to sit below 4GB
+    kuint32_t total_chunks = (max_blocks < PMM_FRAMES_BELOW_4G ? max_blocks : PMM_FRAMES_BELOW_4G) / PMM_BUDDY_CHUNK_BLOCKS;
+
+    kuint32_t run = 0;
+    for (kuint32_t chunk = from_chunk; chunk < total_chunks && run < limit; chunk++) {
+        bool chunk_free = true;
+        for (kuint32_t w = 0; w < words_per_chunk; w++) {
+            if (memory_map[chunk * words_per_chunk + w] != 0) {
+                chunk_free = false;
+                break;
             }
         }
+
+        if (!chunk_free) {
+            run = 0;
+            continue;
+        }
+        if (run == 0) {
+            *first_chunk = chunk;
+        }
+        run++;
+    }
+    return run;
+}
+
+// Carves the buddy arena out of the bitmap, claiming up to PMM_BUDDY_ARENA_MAX_CHUNKS of free chunks but never
+// more than a quarter of the free memory. The arena is taken from above the DMA zone when possible so it does
+// not eat into low memory. The claimed blocks are marked used in the bitmap so the two allocators never overlap.
+static void pmm_buddy_init() {
+    for (kuint32_t order = 0; order <= PMM_BUDDY_MAX_ORDER; order++) {
+        buddy_free_list[order] = PMM_BUDDY_NONE;
+        buddy_free_count[order] = 0;
+    }
+    for (kuint32_t idx = 0; idx < PMM_BUDDY_ARENA_MAX_BLOCKS; idx++) {
+        buddy_nodes[idx].order = PMM_BUDDY_NO_ORDER;
+    }
+
+    kuint32_t words_per_chunk = PMM_BUDDY_CHUNK_BLOCKS / PMM_BITS_PER_ENTRY;
+    kuint32_t chunk_limit = ((max_blocks - used_blocks) / 4) / PMM_BUDDY_CHUNK_BLOCKS;
+    if (chunk_limit > PMM_BUDDY_ARENA_MAX_CHUNKS) {
+        chunk_limit = PMM_BUDDY_ARENA_MAX_CHUNKS;
+    }
+
+    kuint32_t first_chunk = 0;
+    kuint32_t run = pmm_buddy_find_run(PMM_ZONE_DMA_END / (PMM_BUDDY_CHUNK_BLOCKS * PMM_BLOCK_SIZE), chunk_limit, &first_chunk);
+    if (run == 0) {
+        run = pmm_buddy_find_run(0, chunk_limit, &first_chunk);
+    }
+
+    buddy_arena_start = first_chunk * PMM_BUDDY_CHUNK_BLOCKS * PMM_BLOCK_SIZE;
+    buddy_arena_blocks = run * PMM_BUDDY_CHUNK_BLOCKS;
+
+    // Hand the chunks over to the buddy allocator as max order blocks
+    for (kuint32_t chunk = 0; chunk < run; chunk++) {
+        kuint32_t word = (first_chunk + chunk) * words_per_chunk;
+        for (kuint32_t w = 0; w < words_per_chunk; w++) {
+            memory_map[word + w] = PMM_ENTRY_FULL;
+        }
+        pmm_buddy_push(chunk * PMM_BUDDY_CHUNK_BLOCKS, PMM_BUDDY_MAX_ORDER);
+    }
+    used_blocks += buddy_arena_blocks;
+
+    // Blocks from the arena may stand in for blocks of the highest zone it reaches into
+    if (buddy_arena_blocks) {
+        buddy_arena_zone = pmm_zone_of(buddy_arena_start / PMM_BLOCK_SIZE + buddy_arena_blocks - 1);
+    }
+}
+
+// Returns true if the frame belongs to the buddy arena rather than the bitmap.
+static bool pmm_in_buddy_arena(kuint32_t frame) {
+    kuint32_t arena_frame = buddy_arena_start / PMM_BLOCK_SIZE;
+    return buddy_arena_blocks != 0 && frame >= arena_frame && frame - arena_frame < buddy_arena_blocks;
+}
+
+// Builds the page array from the final bitmap. Used blocks start out reserved with a single reference that is
+// never dropped, except for the buddy arena whose blocks are free until the buddy hands them out.
+static void pmm_pages_init() {
+    memset(page_array, 0, page_array_size);
+    for (kuint32_t frame = 0; frame < max_blocks; frame++) {
+        pmm_page_t *page = &page_array[frame];
+        page->lru_next = PMM_PAGE_NONE;
+        page->lru_prev = PMM_PAGE_NONE;
+        if ((memory_map[frame / PMM_BITS_PER_ENTRY] & (1 << (frame % PMM_BITS_PER_ENTRY))) &&
+            !pmm_in_buddy_arena(frame)) {
+            page->refcount = 1;
+            page->flags = PMM_PAGE_RESERVED;
+        }
+    }
+}
+
+// Resets the descriptors of a run of blocks that was just handed out.
+static void pmm_pages_alloc(kuint32_t frame, kuint32_t count) {
+    for (kuint32_t i = 0; i < count; i++) {
+        pmm_page_t *page = pmm_frame_page(frame + i);
+        if (page) {
+            page->refcount = 1;
+            page->flags = 0;
+            page->private_data = 0;
+        }
     }
-    return PMM_NO_FREE_BLOCKS; // No free blocks found
 }
 
 pmm_init_status_t pmm_init(multiboot_info_t *mbi) {
+    kuint64_t init_start = tsc_read();
     pmm_init_status_t status;
     status.error = false;
 
-    // Using the multiboot info, calculate the size of memory/# of blocks we have.
-    // Used determine the bitmap size we need
-    kuint32_t memory_size_kb = mbi->mem_lower + mbi->mem_upper;
-    max_blocks = memory_size_kb * BYTES_PER_KB / PMM_BLOCK_SIZE;
-    size_t bitmap_size = (max_blocks + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+    // Using the multiboot memory map, find the end of the highest available region to size the bitmap.
+    // Memory above 4GB can only be mapped with PAE, which also bounds how much we track.
+    kuint64_t memory_limit = vmm_pae_enabled() ? PMM_PAE_MAX_MEMORY : (kuint64_t)PMM_FRAMES_BELOW_4G * PMM_BLOCK_SIZE;
+    kuint64_t memory_end = 0;
+    multiboot_memory_map_t *mmap = (multiboot_memory_map_t*)mbi->mmap_addr;
+    while((physical_addr_t)mmap < mbi->mmap_addr + mbi->mmap_length) {
+        if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE && mmap->addr + mmap->len > memory_end) {
+            memory_end = mmap->addr + mmap->len;
+        }
+        mmap = (multiboot_memory_map_t*)((physical_addr_t)mmap + mmap->size + sizeof(mmap->size));
+    }
+    if (memory_end > memory_limit) {
+        memory_end = memory_limit;
+    }
+
+    max_blocks = (kuint32_t)(memory_end / PMM_BLOCK_SIZE);
+    kuint32_t memory_size_kb = max_blocks * (PMM_BLOCK_SIZE / BYTES_PER_KB);
+    bitmap_entries = (max_blocks + PMM_BITS_PER_ENTRY - 1) / PMM_BITS_PER_ENTRY;
+    summary_entries = (bitmap_entries + PMM_BITS_PER_ENTRY - 1) / PMM_BITS_PER_ENTRY;
+    size_t bitmap_size = bitmap_entries * sizeof(kuint32_t);
+    size_t summary_size = summary_entries * sizeof(kuint32_t);
+    size_t page_array_offset = (bitmap_size + summary_size + sizeof(pmm_page_t) - 1) & ~(sizeof(pmm_page_t) - 1);
+    page_array_size = max_blocks * sizeof(pmm_page_t);
+    size_t metadata_size = page_array_offset + page_array_size;
 
     status.total_memory_kb = memory_size_kb;
     status.max_blocks = max_blocks;
     status.bitmap_size = bitmap_size;
+    status.summary_size = summary_size;
     status.kernel_start = (physical_addr_t)&_kernel_start;
     status.kernel_end = (physical_addr_t)&_kernel_end;
 
     // ====== STEP 1: Find a place for the memory map. =======
     // The bootloader (GRUB) provides a map of the system's memory layout. We need to iterate through this
-    // map to find a region of available memory that is large enough to hold our PMM bitmap
-    multiboot_memory_map_t *mmap = (multiboot_memory_map_t*)mbi->mmap_addr;
+    // map to find a region of available memory that is large enough to hold our PMM bitmap, its summary and
+    // the page array
+    mmap = (multiboot_memory_map_t*)mbi->mmap_addr;
     physical_addr_t placement_address = 0;
 
     // Loop through each entry in the memory map provided by the bootloader.
     while((physical_addr_t)mmap < mbi->mmap_addr + mbi->mmap_length) {
         // We are only interested in regions that are marked as available for use.
         if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
-            physical_addr_t region_start = mmap->addr;
-            kuint32_t region_len = mmap->len;
+            // The metadata is used through its physical address, so only consider memory below 4GB
+            kuint64_t region_start = mmap->addr;
+            kuint64_t region_end = mmap->addr + mmap->len;
+            if (region_end > (kuint64_t)PMM_FRAMES_BELOW_4G * PMM_BLOCK_SIZE) {
+                region_end = (kuint64_t)PMM_FRAMES_BELOW_4G * PMM_BLOCK_SIZE;
+            }
 
             // Calculate the first possible safe address to place our bitmap.
             // This must be after the kernel's code and data, and aligned to a block boundary.
-            physical_addr_t safe_start = ((physical_addr_t)&_kernel_end + PMM_BLOCK_SIZE - 1) & ~(PMM_BLOCK_SIZE - 1);
+            kuint64_t safe_start = ((physical_addr_t)&_kernel_end + PMM_BLOCK_SIZE - 1) & ~(PMM_BLOCK_SIZE - 1);
 
             // If the available region starts after our calculated safe_start, then we should
             // consider placing the bitmap at the beginning of this region instead.
@@ -83,12 +435,13 @@ pmm_init_status_t pmm_init(multiboot_info_t *mbi) {
             }
 
             // Check if there is any usable space in this region beyond the safe_start address.
-            if (region_start + region_len > safe_start) {
+            // The bitmap and summary stay in the identity mapped DMA zone, only the page array gets remapped.
+            if (region_end > safe_start && safe_start + page_array_offset <= PMM_ZONE_DMA_END) {
                 // Calculate how much space is actually available in this chunk.
-                size_t available_len = region_start + region_len - safe_start;
+                kuint64_t available_len = region_end - safe_start;
 
                 // If there's enough space for our bitmap, we've found our spot.
-                if (available_len >= bitmap_size) {
+                if (available_len >= metadata_size) {
                     placement_address = safe_start;
                     break; // Exit the loop, as we've found a suitable location.
                 }
@@ -105,16 +458,19 @@ pmm_init_status_t pmm_init(multiboot_info_t *mbi) {
         return status;
     }
 
-    // Set our bitmap memory block tracking to the placement address location we found
+    // Set our bitmap memory block tracking to the placement address location we found, the summary follows it
     memory_map = (physical_addr_t*)placement_address;
+    memory_map_summary = (kuint32_t*)(placement_address + bitmap_size);
+    page_array_start = placement_address + page_array_offset;
+    page_array = (pmm_page_t*)page_array_start;
     status.placement_address = placement_address;
+    status.page_array_start = page_array_start;
+    status.page_array_size = page_array_size;
 
 
     // ====== STEP 2: Clear and initialize the bitmap/memory. =======
     // Initially, mark all memory blocks in the bitmap as used.
-    for (kuint32_t i = 0; i < max_blocks / PMM_BITS_PER_ENTRY; i++) {
-        memory_map[i] = PMM_ENTRY_FULL;
-    }
+    memset(memory_map, 0xFF, bitmap_entries * sizeof(kuint32_t));
 
     // Second pass over the memory map. This time, we're initializing the bitmap.
     mmap = (multiboot_memory_map_t*)mbi->mmap_addr;
@@ -125,64 +481,429 @@ pmm_init_status_t pmm_init(multiboot_info_t *mbi) {
             kuint64_t region_addr = mmap->addr;
             kuint64_t region_len = mmap->len;
 
-            // Iterate through the memory region in block-sized steps.
-            for (kuint64_t i = 0; i < region_len; i += PMM_BLOCK_SIZE) {
-                kuint64_t current_addr = region_addr + i;
+            kuint64_t region_end = region_addr + region_len;
 
-                // We only manage memory starting from (PMM_MANAGEABLE_MEMORY_START),
-                // Also skip any memory that is beyond our PMM's 32-bit (4GB) limit.
-                if (current_addr >= PMM_MANAGEABLE_MEMORY_START && current_addr < 0x100000000) {
-                    pmm_clear_bit((physical_addr_t)(current_addr / PMM_BLOCK_SIZE));
-                }
+            // We only manage memory starting from (PMM_MANAGEABLE_MEMORY_START),
+            // Also clip any memory that is beyond the end of the bitmap.
+            if (region_addr < PMM_MANAGEABLE_MEMORY_START) {
+                region_addr = PMM_MANAGEABLE_MEMORY_START;
+            }
+            if (region_end > (kuint64_t)max_blocks * PMM_BLOCK_SIZE) {
+                region_end = (kuint64_t)max_blocks * PMM_BLOCK_SIZE;
+            }
+
+            // Only whole blocks inside the region are usable
+            if (region_addr < region_end) {
+                pmm_mark_range((kuint32_t)((region_addr + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE),
+                               (kuint32_t)(region_end / PMM_BLOCK_SIZE), false);
             }
         }
         // Advance to the next entry in the memory map.
         mmap = (multiboot_memory_map_t*)((physical_addr_t)mmap + mmap->size + sizeof(mmap->size));
     }
 
-    // Re-mark the kernel and bitmap as used.
+    // Re-mark the kernel, bitmap, summary and page array as used.
     kuint32_t kernel_start_block = (kuint32_t)&_kernel_start / PMM_BLOCK_SIZE;
     kuint32_t kernel_end_block = ((kuint32_t)&_kernel_end + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
-    for (kuint32_t i = kernel_start_block; i <= kernel_end_block; i++) {
-        pmm_set_bit(i);
-    }
+    pmm_mark_range(kernel_start_block, kernel_end_block + 1, true);
 
     kuint32_t bitmap_block_start = (kuint32_t)memory_map / PMM_BLOCK_SIZE;
-    kuint32_t bitmap_block_end = ((kuint32_t)memory_map + bitmap_size) / PMM_BLOCK_SIZE;
-    for (kuint32_t i = bitmap_block_start; i <= bitmap_block_end; i++) {
-        pmm_set_bit(i);
-    }
+    kuint32_t bitmap_block_end = ((kuint32_t)memory_map + metadata_size) / PMM_BLOCK_SIZE;
+    pmm_mark_range(bitmap_block_start, bitmap_block_end + 1, true);
 
-    // Iterate and set the number of used blocks after final init
-    used_blocks = 0;
-    for (kuint32_t i = 0; i < max_blocks; i++) {
-        if (pmm_test_bit(i)) used_blocks++;
-    }
+    // Count the used blocks after final init
+    used_blocks = pmm_count_used(0, max_blocks);
+
+    // Reserve the buddy arena for multi-block allocations
+    pmm_buddy_init();
+    status.buddy_arena_start = buddy_arena_start;
+    status.buddy_arena_blocks = buddy_arena_blocks;
     status.used_blocks = used_blocks;
+    pmm_pages_init();
+
+    // The bitmap was written directly above, so build the summary from scratch and split it into zones
+    pmm_rebuild_summary();
+    pmm_zones_init();
+    for (kuint32_t z = 0; z < PMM_ZONE_COUNT; z++) {
+        status.zone_blocks[z] = pmm_zones[z].total_blocks;
+        status.zone_free_blocks[z] = pmm_zones[z].free_blocks;
+    }
 
+    status.init_us = tsc_cycles_to_us(tsc_read() - init_start);
+    LOG_INFO("PMM initialized in %d us (%d blocks, %d used)", status.init_us, max_blocks, used_blocks);
     return status;
 }
 
-generic_ptr pmm_alloc_block() {
+// Takes the next free block of a zone from the bitmap, returns PMM_NO_FREE_BLOCKS once it is exhausted.
+static kint32_t pmm_bitmap_alloc(pmm_zone_t zone) {
     // Find the first free block.
-    kint32_t frame = pmm_find_first_free();
+    kint32_t frame = pmm_find_first_free(&pmm_zones[zone]);
     if (frame == PMM_NO_FREE_BLOCKS) {
-        return 0; // Out of memory
+        return PMM_NO_FREE_BLOCKS;
     }
 
     // Mark the block as used.
     pmm_set_bit(frame);
     used_blocks++;
+    pmm_zones[zone].free_blocks--;
+    return frame;
+}
 
-    // Calculate and return the physical address.
-    return (generic_ptr)(frame * PMM_BLOCK_SIZE);
+// Returns a block to the bitmap.
+static void pmm_bitmap_free(kuint32_t frame) {
+    pmm_clear_bit(frame);
+    used_blocks--;
+    pmm_zones[pmm_zone_of(frame)].free_blocks++;
+}
+
+static generic_ptr pmm_buddy_alloc(kuint32_t order) {
+    if (order > PMM_BUDDY_MAX_ORDER) {
+        return 0;
+    }
+
+    // Find the smallest order with a free block that can satisfy the request
+    kuint32_t current = order;
+    while (current <= PMM_BUDDY_MAX_ORDER && buddy_free_list[current] == PMM_BUDDY_NONE) {
+        current++;
+    }
+    if (current > PMM_BUDDY_MAX_ORDER) {
+        return 0; // Out of contiguous memory
+    }
+
+    kuint32_t idx = buddy_free_list[current];
+    pmm_buddy_unlink(idx);
+
+    // Split the block in half until it is the requested size, the upper halves go back on the free lists
+    while (current > order) {
+        current--;
+        pmm_buddy_push(idx + (1 << current), current);
+    }
+    buddy_nodes[idx].order = order;
+
+    return (generic_ptr)(buddy_arena_start + idx * PMM_BLOCK_SIZE);
+}
+
+static bool pmm_buddy_free(physical_addr_t addr, kuint32_t order) {
+    if (!pmm_in_buddy_arena(addr / PMM_BLOCK_SIZE) || order > PMM_BUDDY_MAX_ORDER) {
+        LOG_ERR("PMM Error: 0x%x (order %d) is not a buddy allocation!", addr, order);
+        return false;
+    }
+
+    kuint32_t idx = (addr - buddy_arena_start) / PMM_BLOCK_SIZE;
+    if ((idx & ((1 << order) - 1)) != 0 || buddy_nodes[idx].free) {
+        LOG_ERR("PMM Error: Invalid or double free of 0x%x (order %d)!", addr, order);
+        return false;
+    }
+    // A free with the wrong order would hand neighbouring blocks back to the free lists or leak part of the block
+    if (buddy_nodes[idx].order != order) {
+        LOG_ERR("PMM Error: 0x%x was allocated with order %d but freed with order %d!", addr, buddy_nodes[idx].order, order);
+        return false;
+    }
+
+    // Merge with our buddy for as long as it is free and whole, each merge doubles the block
+    while (order < PMM_BUDDY_MAX_ORDER) {
+        kuint32_t buddy = idx ^ (1 << order);
+        if (buddy >= buddy_arena_blocks || !buddy_nodes[buddy].free || buddy_nodes[buddy].order != order) {
+            break;
+        }
+        pmm_buddy_unlink(buddy);
+        // The upper half now lies inside the merged block
+        buddy_nodes[idx > buddy ? idx : buddy].order = PMM_BUDDY_NO_ORDER;
+        idx = idx < buddy ? idx : buddy;
+        order++;
+    }
+    pmm_buddy_push(idx, order);
+    return true;
+}
+
+// Fills an empty magazine with a batch of blocks from its zone, taking the global lock only once.
+static void pmm_magazine_refill(pmm_magazine_t *mag, pmm_zone_t zone) {
+    spinlock_acquire(&pmm_lock);
+    while (mag->count < PMM_MAGAZINE_BATCH) {
+        kint32_t frame = pmm_bitmap_alloc(zone);
+        if (frame == PMM_NO_FREE_BLOCKS) {
+            break;
+        }
+        mag->frames[mag->count++] = frame;
+    }
+    spinlock_release(&pmm_lock);
+    mag->refills++;
+}
+
+// Returns a batch of blocks from a full magazine to the bitmap, taking the global lock only once.
+static void pmm_magazine_drain(pmm_magazine_t *mag) {
+    spinlock_acquire(&pmm_lock);
+    for (kuint32_t i = 0; i < PMM_MAGAZINE_BATCH && mag->count > 0; i++) {
+        pmm_bitmap_free(mag->frames[--mag->count]);
+    }
+    spinlock_release(&pmm_lock);
+    mag->drains++;
+}
+
+generic_ptr pmm_alloc_block() {
+    return pmm_alloc_block_zone(PMM_ZONE_HIGH);
+}
+
+generic_ptr pmm_alloc_block_zone(pmm_zone_t zone) {
+    // Blocks are handed out by address, so they have to come from below 4GB
+    if (zone > PMM_ZONE_HIGH) {
+        zone = PMM_ZONE_HIGH;
+    }
+    return (generic_ptr)(pmm_alloc_frame(zone) * PMM_BLOCK_SIZE);
+}
+
+kuint32_t pmm_alloc_frame(pmm_zone_t zone) {
+    if (zone >= PMM_ZONE_COUNT) {
+        return PMM_NO_FRAME;
+    }
+
+    // The magazines belong to this CPU, so keeping interrupts off is enough to own them
+    kuint32_t flags = interrupts_save();
+    kuint32_t frame = PMM_NO_FRAME;
+
+    // Try the requested zone first, then fall back towards the DMA zone
+    for (kint32_t z = zone; z >= 0 && frame == PMM_NO_FRAME; z--) {
+        pmm_magazine_t *mag = &pmm_magazines[pmm_cpu_id()][z];
+        if (mag->count == 0) {
+            if (pmm_zones[z].free_blocks == 0) {
+                continue;
+            }
+            mag->misses++;
+            pmm_magazine_refill(mag, z);
+        } else {
+            mag->hits++;
+        }
+
+        if (mag->count > 0) {
+            frame = mag->frames[--mag->count];
+        }
+    }
+
+    // The bitmap is exhausted, fall back to a single block from the buddy arena if it suits the zone
+    if (frame == PMM_NO_FRAME && zone >= buddy_arena_zone) {
+        spinlock_acquire(&pmm_lock);
+        frame = (physical_addr_t)pmm_buddy_alloc(0) / PMM_BLOCK_SIZE;
+        spinlock_release(&pmm_lock);
+    }
+    if (frame != PMM_NO_FRAME) {
+        pmm_pages_alloc(frame, 1);
+    }
+
+    interrupts_restore(flags);
+    return frame;
 }
 
 void pmm_free_block(generic_ptr p) {
-    // Calculate the block index from the address.
-    kuint32_t frame = (physical_addr_t)p / PMM_BLOCK_SIZE;
+    pmm_free_frame((physical_addr_t)p / PMM_BLOCK_SIZE);
+}
 
-    // Mark the block as free.
-    pmm_clear_bit(frame);
-    used_blocks--;
+void pmm_free_frame(kuint32_t frame) {
+    kuint32_t flags = interrupts_save();
+
+    // Drop the caller's reference, the block only goes back once nobody else holds it
+    pmm_page_t *page = pmm_frame_page(frame);
+    if (page) {
+        if (page->refcount == 0) {
+            LOG_ERR("PMM Error: Double free of frame 0x%x!", frame);
+            interrupts_restore(flags);
+            return;
+        }
+        if (--page->refcount > 0) {
+            interrupts_restore(flags);
+            return;
+        }
+        page->flags = 0;
+    }
+
+    if (pmm_in_buddy_arena(frame)) {
+        // Single blocks handed out from the buddy arena go straight back to it so the arena can coalesce
+        spinlock_acquire(&pmm_lock);
+        pmm_buddy_free(frame * PMM_BLOCK_SIZE, 0);
+        spinlock_release(&pmm_lock);
+    } else {
+        pmm_magazine_t *mag = &pmm_magazines[pmm_cpu_id()][pmm_zone_of(frame)];
+        if (mag->count == PMM_MAGAZINE_SIZE) {
+            pmm_magazine_drain(mag);
+        }
+        mag->frames[mag->count++] = frame;
+    }
+
+    interrupts_restore(flags);
+}
+
+generic_ptr pmm_alloc_blocks(kuint32_t order) {
+    kuint32_t flags = interrupts_save();
+    spinlock_acquire(&pmm_lock);
+    generic_ptr block = pmm_buddy_alloc(order);
+    spinlock_release(&pmm_lock);
+    if (block) {
+        pmm_pages_alloc((physical_addr_t)block / PMM_BLOCK_SIZE, 1 << order);
+    }
+    interrupts_restore(flags);
+    return block;
+}
+
+void pmm_free_blocks(generic_ptr p, kuint32_t order) {
+    kuint32_t flags = interrupts_save();
+    spinlock_acquire(&pmm_lock);
+    bool freed = pmm_buddy_free((physical_addr_t)p, order);
+    spinlock_release(&pmm_lock);
+    if (freed) {
+        for (kuint32_t i = 0; i < (1u << order); i++) {
+            pmm_page_t *page = pmm_page((physical_addr_t)p + i * PMM_BLOCK_SIZE);
+            page->refcount = 0;
+            page->flags = 0;
+        }
+    }
+    interrupts_restore(flags);
+}
+
+kuint32_t pmm_alloc_zeroed_frame(pmm_zone_t zone) {
+    // Pooled frames come from any zone, so only take the top one if the caller can use it
+    kuint32_t flags = interrupts_save();
+    kuint32_t frame = PMM_NO_FRAME;
+    if (pmm_zero_pool.count > 0 && pmm_zone_of(pmm_zero_pool.frames[pmm_zero_pool.count - 1]) <= zone) {
+        frame = pmm_zero_pool.frames[--pmm_zero_pool.count];
+        pmm_zero_pool.hits++;
+    } else {
+        pmm_zero_pool.misses++;
+    }
+    interrupts_restore(flags);
+
+    // The pool ran dry, zero a frame inline
+    if (frame == PMM_NO_FRAME) {
+        frame = pmm_alloc_frame(zone);
+        if (frame != PMM_NO_FRAME) {
+            vmm_zero_frame(frame);
+        }
+    }
+    return frame;
+}
+
+void pmm_zero_pool_refill() {
+    for (kuint32_t i = 0; i < PMM_ZERO_POOL_REFILL_BATCH && pmm_zero_pool.count < PMM_ZERO_POOL_SIZE; i++) {
+        kuint32_t frame = pmm_alloc_frame(PMM_ZONE_HIGH64);
+        if (frame == PMM_NO_FRAME) {
+            return;
+        }
+
+        // Zero with interrupts on, the pool itself is only touched with them off
+        vmm_zero_frame(frame);
+
+        kuint32_t flags = interrupts_save();
+        bool full = pmm_zero_pool.count == PMM_ZERO_POOL_SIZE;
+        if (!full) {
+            pmm_zero_pool.frames[pmm_zero_pool.count++] = frame;
+        }
+        interrupts_restore(flags);
+
+        if (full) {
+            pmm_free_frame(frame);
+            return;
+        }
+    }
+}
+
+void pmm_get_zero_pool_stats(pmm_zero_pool_stats_t *stats) {
+    kuint32_t flags = interrupts_save();
+    stats->hits = pmm_zero_pool.hits;
+    stats->misses = pmm_zero_pool.misses;
+    stats->cached_blocks = pmm_zero_pool.count;
+    interrupts_restore(flags);
+}
+
+pmm_page_t* pmm_page(physical_addr_t addr) {
+    return pmm_frame_page(addr / PMM_BLOCK_SIZE);
+}
+
+pmm_page_t* pmm_frame_page(kuint32_t frame) {
+    if (!page_array || frame >= max_blocks) {
+        return 0;
+    }
+    return &page_array[frame];
+}
+
+void pmm_page_ref(physical_addr_t addr) {
+    pmm_frame_ref(addr / PMM_BLOCK_SIZE);
+}
+
+void pmm_frame_ref(kuint32_t frame) {
+    kuint32_t flags = interrupts_save();
+    pmm_page_t *page = pmm_frame_page(frame);
+    if (page) {
+        page->refcount++;
+    }
+    interrupts_restore(flags);
+}
+
+physical_addr_t pmm_get_page_array_start() {
+    return page_array_start;
+}
+
+size_t pmm_get_page_array_size() {
+    return page_array_size;
+}
+
+void pmm_set_page_array(pmm_page_t *pages) {
+    page_array = pages;
+}
+
+kuint32_t pmm_get_free_blocks() {
+    // Blocks cached in the magazines are counted as used by the bitmap, but are free to hand out
+    kuint32_t cached = 0;
+    for (kuint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        for (kuint32_t z = 0; z < PMM_ZONE_COUNT; z++) {
+            cached += pmm_magazines[cpu][z].count;
+        }
+    }
+    return max_blocks - used_blocks + cached + pmm_zero_pool.count;
+}
+
+kuint32_t pmm_get_zone_free_blocks(pmm_zone_t zone) {
+    if (zone >= PMM_ZONE_COUNT) {
+        return 0;
+    }
+
+    kuint32_t cached = 0;
+    for (kuint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        cached += pmm_magazines[cpu][zone].count;
+    }
+    return pmm_zones[zone].free_blocks + cached;
+}
+
+void pmm_get_magazine_stats(pmm_magazine_stats_t *stats) {
+    memset(stats, 0, sizeof(pmm_magazine_stats_t));
+    for (kuint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        for (kuint32_t z = 0; z < PMM_ZONE_COUNT; z++) {
+            pmm_magazine_t *mag = &pmm_magazines[cpu][z];
+            stats->hits += mag->hits;
+            stats->misses += mag->misses;
+            stats->refills += mag->refills;
+            stats->drains += mag->drains;
+            stats->cached_blocks += mag->count;
+        }
+    }
+
+    kuint32_t total = stats->hits + stats->misses;
+    stats->hit_rate_pct = total ? (kuint32_t)(((kuint64_t)stats->hits * 100) / total) : 0;
+}
+
+void pmm_get_buddy_stats(pmm_buddy_stats_t *stats) {
+    stats->arena_blocks = buddy_arena_blocks;
+    stats->free_blocks = 0;
+    stats->largest_free_order = 0;
+    for (kuint32_t order = 0; order <= PMM_BUDDY_MAX_ORDER; order++) {
+        stats->free_per_order[order] = buddy_free_count[order];
+        stats->free_blocks += buddy_free_count[order] << order;
+        if (buddy_free_count[order]) {
+            stats->largest_free_order = order;
+        }
+    }
+
+    // Fragmentation is the share of free memory that is not part of the largest free block size
+    stats->fragmentation_pct = 0;
+    if (stats->free_blocks) {
+        kuint32_t largest = buddy_free_count[stats->largest_free_order] << stats->largest_free_order;
+        stats->fragmentation_pct = 100 - (largest * 100) / stats->free_blocks;
+    }
 }
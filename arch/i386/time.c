@@ -2,10 +2,14 @@
 #include <arch/i386/io.h>
 #include <arch/i386/pic.h>
 #include <kernel/time.h>
+#include <drivers/pit.h>
 
 kint32_t century_register = CENTURY_DATA_PORT;
 cmos_time_t current_time;
 
+// TSC frequency in KHz, 0 until tsc_calibrate() has run
+static kuint32_t tsc_khz = 0;
+
 // Days in each month (non-leap year)
 static const kint32_t days_in_month[] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 
@@ -162,4 +166,41 @@ void rtc_handler(registers_t* regs) {
     // Send EOI to slave and master PICs.
     outb(0xA0, PIC_EOI); // Slave
     outb(0x20, PIC_EOI); // Master
-}
\ No newline at end of file
+}
+
+kuint64_t tsc_read() {
+    kuint64_t cycles;
+    asm volatile("rdtsc" : "=A" (cycles));
+    return cycles;
+}
+
+void tsc_calibrate() {
+    // Gate channel 2 off with the speaker disabled, then program a one-shot countdown of TSC_CALIBRATE_MS
+    kuint8_t gate = inb(PIT_CHANNEL_2_GATE_PORT) & ~(PIT_CHANNEL_2_SPEAKER | PIT_CHANNEL_2_GATE);
+    outb(PIT_CHANNEL_2_GATE_PORT, gate);
+
+    kuint32_t count = (PIT_BASE_FREQUENCY * TSC_CALIBRATE_MS) / 1000;
+    outb(PIT_COMMAND_PORT, 0xB0);   // Channel 2, Access Mode Low/High, Mode 0 (Interrupt on terminal count)
+    outb(PIT_CHANNEL_2_DATA_PORT, (kuint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL_2_DATA_PORT, (kuint8_t)((count >> 8) & 0xFF));
+
+    // Raising the gate starts the countdown, OUT2 goes high once it reaches zero
+    outb(PIT_CHANNEL_2_GATE_PORT, gate | PIT_CHANNEL_2_GATE);
+    kuint64_t start = tsc_read();
+    while (!(inb(PIT_CHANNEL_2_GATE_PORT) & PIT_CHANNEL_2_OUT));
+    kuint64_t end = tsc_read();
+    outb(PIT_CHANNEL_2_GATE_PORT, gate);
+
+    tsc_khz = (kuint32_t)((end - start) / TSC_CALIBRATE_MS);
+}
+
+kuint32_t tsc_get_khz() {
+    return tsc_khz;
+}
+
+kuint32_t tsc_cycles_to_us(kuint64_t cycles) {
+    if (tsc_khz == 0) {
+        return 0;
+    }
+    return (kuint32_t)((cycles * 1000) / tsc_khz);
+}
@@ -1,55 +1,486 @@
 #include <arch/i386/vmm.h>
 #include <arch/i386/pmm.h>
 #include <kernel/log.h>
+#include <kernel/kernel_layout.h>
+#include <kernel/sync.h>
+#include <kernel/proc.h>
+#include <kernel/vmalloc.h>
 
-// Pointers to our page directory and a page table
+// Pointer to our page directory, under PAE this is the page directory pointer table
 pde_t* page_directory = 0;
-pte_t* first_page_table = 0;
+
+// Paging mode selected at boot, see vmm_select_paging_mode()
+static bool pae_enabled = false;
+static bool nx_enabled = false;
+
+// Large pages are 4MB with PSE, or 2MB under PAE where the CPU always supports them
+static bool large_pages_enabled = false;
+
+// With PGE, supervisor mappings are global and survive the CR3 reload of an address space switch
+static bool pge_supported = false;
+static bool pge_enabled = false;
+
+// Set once paging is on, from then on paging structures are reached through the recursive mapping
+static bool paging_enabled = false;
+
+// Temporary mapping slots in use
+static kuint32_t kmap_used = 0;
+
+// Areas in the kernel half, user areas belong to their process
+static vmm_vma_set_t kernel_vmas;
+
+// Read faults on anonymous user memory map this frame read only until the first write. It is never reference
+// counted, so it can back any number of pages and is never freed.
+static kuint32_t zero_frame = PMM_NO_FRAME;
+static vmm_fault_stats_t fault_stats;
 
 // Assembly functions defined in vmm_asm.s
-void load_page_directory(pde_t* page_directory_physical_addr);
 void enable_paging();
+void enable_pae();
+void enable_nx();
+void enable_pse();
+void enable_pge();
+void disable_pge();
 void flush_tlb_single(kuint32_t virtual_addr);
 kuint32_t read_cr2();
+kuint32_t read_cr3();
 
-vmm_init_status_t vmm_init(multiboot_info_t* mbi) {
-    LOG_DEBUG("Setting up VMM...");
+static void vmm_cpuid(kuint32_t leaf, kuint32_t* eax, kuint32_t* edx) {
+    kuint32_t ebx, ecx;
+    asm volatile("cpuid" : "=a"(*eax), "=b"(ebx), "=c"(ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
 
-    // Allocate frames for the page directory and one page table
-    page_directory = (pde_t*)pmm_alloc_block();
-    first_page_table = (pte_t*)pmm_alloc_block();
+// Returns true if the space separated command line contains the given option
+static bool vmm_cmdline_has(const char* cmdline, const char* option) {
+    size_t len = strlen(option);
+    for (const char* p = cmdline; *p; p++) {
+        if ((p == cmdline || p[-1] == ' ') && strncmp(p, option, len) == 0 && (p[len] == ' ' || p[len] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (!page_directory || !first_page_table) {
-        LOG_ERR("VMM Error: Failed to allocate frames for paging structures.");
+bool vmm_select_paging_mode(multiboot_info_t* mbi) {
+    if (!mbi || !CHECK_MULTIBOOT_FLAG(mbi->flags, 2) || !vmm_cmdline_has((const char*)mbi->cmdline, "pae")) {
+        return false;
+    }
+
+    kuint32_t eax, edx;
+    vmm_cpuid(1, &eax, &edx);
+    if (!(edx & CPUID_EDX_PAE)) {
+        LOG_WARN("VMM: PAE requested but not supported by this CPU.");
+        return false;
+    }
+    pae_enabled = true;
+
+    // The NX bit needs PAE and is reported in the extended leaves
+    vmm_cpuid(0x80000000, &eax, &edx);
+    if (eax >= 0x80000001) {
+        vmm_cpuid(0x80000001, &eax, &edx);
+        nx_enabled = (edx & CPUID_EXT_EDX_NX) != 0;
+    }
+    return true;
+}
+
+bool vmm_pae_enabled() {
+    return pae_enabled;
+}
+
+// Page directory and page table entries are 32 bits wide, or 64 bits under PAE. These helpers hide the
+// difference so the rest of the VMM can walk tables the same way in both modes.
+static kuint64_t vmm_read_entry(generic_ptr entries, kuint32_t index) {
+    if (pae_enabled) {
+        return ((kuint64_t*)entries)[index];
+    }
+    return ((kuint32_t*)entries)[index];
+}
+
+// A 64 bit entry is written as two halves, ordered so the CPU never sees a present entry that is half written
+static void vmm_write_entry(generic_ptr entries, kuint32_t index, kuint64_t value) {
+    if (!pae_enabled) {
+        ((kuint32_t*)entries)[index] = (kuint32_t)value;
         return;
     }
 
-    // Clear the allocated memory to ensure no stale data
-    memset(page_directory, 0, PAGE_SIZE);
-    memset(first_page_table, 0, PAGE_SIZE);
+    volatile kuint32_t* halves = (volatile kuint32_t*)entries + index * 2;
+    if (value & PTE_PRESENT) {
+        halves[1] = (kuint32_t)(value >> 32);
+        halves[0] = (kuint32_t)value;
+    } else {
+        halves[0] = (kuint32_t)value;
+        halves[1] = (kuint32_t)(value >> 32);
+    }
+}
+
+static kuint64_t vmm_make_entry(kuint32_t frame, kuint32_t flags) {
+    kuint64_t entry = ((kuint64_t)frame << 12) | (flags & ~PTE_FRAME) | ((flags & PTE_PROT_NONE) ? 0 : PTE_PRESENT);
+    if ((flags & PTE_NO_EXECUTE) && nx_enabled) {
+        entry |= PAE_NO_EXECUTE;
+    }
+    return entry;
+}
+
+// Supervisor mappings look the same in every address space, so they are marked global when PGE is on
+static kuint32_t vmm_leaf_flags(kuint32_t flags) {
+    if (pge_supported && !(flags & PTE_USER)) {
+        flags |= PTE_GLOBAL;
+    }
+    return flags;
+}
+
+// PROT_NONE pages are not present to the CPU but their entries still own a frame
+static bool vmm_entry_mapped(kuint64_t entry) {
+    return (entry & (PTE_PRESENT | PTE_PROT_NONE)) != 0;
+}
+
+static kuint32_t vmm_entry_frame(kuint64_t entry) {
+    return (kuint32_t)((entry & (pae_enabled ? PAE_FRAME : PTE_FRAME)) >> 12);
+}
+
+static kuint32_t vmm_table_index(virtual_addr_t virtual_addr) {
+    return (virtual_addr >> 12) & ((pae_enabled ? PAE_TABLE_ENTRIES : TABLE_ENTRIES) - 1);
+}
+
+// Each directory entry covers 4MB, or 2MB under PAE
+static kuint32_t vmm_directory_shift() {
+    return pae_enabled ? 21 : 22;
+}
+
+// Returns a pointer to a frame, through its physical address before paging is on and through a temporary
+// mapping afterwards. The pointer must be released with vmm_release().
+static generic_ptr vmm_access_frame(kuint32_t frame) {
+    if (!paging_enabled) {
+        return (generic_ptr)(frame * PAGE_SIZE);
+    }
+    return vmm_kmap(frame);
+}
+
+static void vmm_release(generic_ptr addr) {
+    if ((virtual_addr_t)addr >= KMAP_VIRTUAL_START && (virtual_addr_t)addr < KMAP_VIRTUAL_START + KMAP_SLOTS * PAGE_SIZE) {
+        vmm_kunmap(addr);
+    }
+}
+
+static bool vmm_is_current(pde_t* dir) {
+    return paging_enabled && (physical_addr_t)dir == (read_cr3() & PTE_FRAME);
+}
+
+// Returns the frame of the page directory covering an address
+static kuint32_t vmm_directory_frame(pde_t* dir, virtual_addr_t virtual_addr) {
+    if (!pae_enabled) {
+        return (physical_addr_t)dir / PAGE_SIZE;
+    }
+
+    // Under PAE the directory is picked from the four the page directory pointer table points at
+    generic_ptr pdpt = vmm_access_frame((physical_addr_t)dir / PAGE_SIZE);
+    kuint32_t frame = vmm_entry_frame(vmm_read_entry(pdpt, virtual_addr >> 30));
+    vmm_release(pdpt);
+    return frame;
+}
 
-    // Identity map the first 4MB of memory in our first page table
-    for (int i = 0; i < TABLE_ENTRIES; i++) {
-        kuint32_t frame_address = i * PAGE_SIZE;
-        first_page_table[i] = frame_address | PTE_PRESENT | PTE_READ_WRITE;
+// Returns the page directory holding the entry for an address and the index of that entry. The active
+// directory is reached through its recursive mapping, any other one through a temporary mapping.
+static generic_ptr vmm_get_directory(pde_t* dir, virtual_addr_t virtual_addr, kuint32_t* index) {
+    if (vmm_is_current(dir)) {
+        *index = virtual_addr >> vmm_directory_shift();
+        return (generic_ptr)(pae_enabled ? PAE_RECURSIVE_DIRECTORY : VMM_RECURSIVE_DIRECTORY);
     }
 
-    // Point the first entry of the page directory to our page table.
-    // The address must be the PHYSICAL address of the page table.
-    page_directory[0] = (pde_t)first_page_table | PDE_PRESENT | PDE_READ_WRITE;
+    *index = (virtual_addr >> vmm_directory_shift()) & ((pae_enabled ? PAE_TABLE_ENTRIES : TABLE_ENTRIES) - 1);
+    return vmm_access_frame(vmm_directory_frame(dir, virtual_addr));
+}
+
+// Allocates a zeroed frame for a paging structure. Once paging is on the frame can come from any zone the
+// caller allows, before that it has to be reachable through its physical address.
+static kuint32_t vmm_alloc_table(pmm_zone_t zone) {
+    if (!paging_enabled && zone > PMM_ZONE_HIGH) {
+        zone = PMM_ZONE_HIGH;
+    }
+
+    kuint32_t frame = pmm_alloc_zeroed_frame(zone);
+    if (frame != PMM_NO_FRAME) {
+        pmm_frame_page(frame)->flags |= PMM_PAGE_TABLE;
+    }
+    return frame;
+}
+
+// Allocates an empty page directory mapped into its own last slot. Under PAE this is a page directory pointer
+// table with its four page directories, the last of which maps all four. CR3 only holds 32 bits, so the
+// top level has to sit below 4GB.
+static pde_t* vmm_alloc_directory() {
+    kuint32_t root = vmm_alloc_table(PMM_ZONE_HIGH);
+    if (root == PMM_NO_FRAME) {
+        return NULL;
+    }
+
+    generic_ptr entries = vmm_access_frame(root);
+    if (!pae_enabled) {
+        vmm_write_entry(entries, VMM_RECURSIVE_SLOT, vmm_make_entry(root, PDE_READ_WRITE));
+        vmm_release(entries);
+        return (pde_t*)(root * PAGE_SIZE);
+    }
+
+    kuint32_t pds[PAE_PDPT_ENTRIES];
+    for (kuint32_t i = 0; i < PAE_PDPT_ENTRIES; i++) {
+        pds[i] = vmm_alloc_table(PMM_ZONE_HIGH64);
+        if (pds[i] == PMM_NO_FRAME) {
+            vmm_release(entries);
+            while (i-- > 0) {
+                pmm_free_frame(pds[i]);
+            }
+            pmm_free_frame(root);
+            return NULL;
+        }
+        // PDPT entries only take the present and caching bits
+        vmm_write_entry(entries, i, ((kuint64_t)pds[i] << 12) | PDE_PRESENT);
+    }
+    vmm_release(entries);
+
+    generic_ptr last = vmm_access_frame(pds[PAE_PDPT_ENTRIES - 1]);
+    for (kuint32_t i = 0; i < PAE_PDPT_ENTRIES; i++) {
+        vmm_write_entry(last, PAE_RECURSIVE_SLOT + i, vmm_make_entry(pds[i], PDE_READ_WRITE));
+    }
+    vmm_release(last);
+    return (pde_t*)(root * PAGE_SIZE);
+}
+
+// Fills a fresh page table with 4KB entries covering the same frames as a large page directory entry
+static void vmm_split_large_page(kuint32_t table_frame, kuint64_t pde) {
+    kuint32_t entries = pae_enabled ? PAE_TABLE_ENTRIES : TABLE_ENTRIES;
+    kuint32_t first = vmm_entry_frame(pde) & ~(entries - 1);
+    kuint32_t flags = ((kuint32_t)pde & ~(PTE_FRAME | PDE_PAGE_SIZE | PTE_ACCESSED | PTE_DIRTY)) |
+                      ((pde & PAE_NO_EXECUTE) ? PTE_NO_EXECUTE : 0);
+
+    generic_ptr table = vmm_access_frame(table_frame);
+    for (kuint32_t i = 0; i < entries; i++) {
+        vmm_write_entry(table, i, vmm_make_entry(first + i, flags));
+    }
+    vmm_release(table);
+}
+
+// Returns a pointer to the page table covering an address. If there is none it is created when 'create' is
+// set, the user bit of 'flags' carries over to the new directory entry. A large page covering the address is
+// split into a table. The pointer must be released with vmm_release().
+static generic_ptr vmm_get_table(pde_t* dir, virtual_addr_t virtual_addr, bool create, kuint32_t flags) {
+    kuint32_t index;
+    generic_ptr pd = vmm_get_directory(dir, virtual_addr, &index);
+    if (!pd) {
+        return NULL;
+    }
+
+    kuint64_t pde = vmm_read_entry(pd, index);
+    bool created = false, split = false;
+    if (!(pde & PDE_PRESENT) || (pde & PDE_PAGE_SIZE)) {
+        if (!(pde & PDE_PRESENT) && !create) {
+            vmm_release(pd);
+            return NULL;
+        }
+
+        // If the page table for this address range isn't present, we need to create one
+        kuint32_t frame = vmm_alloc_table(PMM_ZONE_HIGH64);
+        if (frame == PMM_NO_FRAME) {
+            LOG_ERR("VMM Error: Out of memory creating new page table!");
+            vmm_release(pd);
+            return NULL;
+        }
+
+        if (pde & PDE_PAGE_SIZE) {
+            // A large page is in the way, it is split into a table mapping the same frames with the same rights
+            vmm_split_large_page(frame, pde);
+            split = true;
+            pde = vmm_make_entry(frame, PDE_READ_WRITE | ((kuint32_t)pde & PDE_USER));
+        } else {
+            pde = vmm_make_entry(frame, PDE_READ_WRITE | (flags & PTE_USER));
+        }
+        vmm_write_entry(pd, index, pde);
+        created = true;
+    }
+    vmm_release(pd);
+
+    if (!vmm_is_current(dir)) {
+        return vmm_access_frame(vmm_entry_frame(pde));
+    }
+
+    // Every table of the active directory shows up in the recursive tables window
+    virtual_addr_t table = (pae_enabled ? PAE_RECURSIVE_TABLES : VMM_RECURSIVE_TABLES) +
+                           (virtual_addr >> vmm_directory_shift()) * PAGE_SIZE;
+    if (created) {
+        flush_tlb_single(table);
+    }
+    if (split) {
+        flush_tlb_single(virtual_addr);
+    }
+    return (generic_ptr)table;
+}
+
+size_t vmm_large_page_size() {
+    if (!large_pages_enabled) {
+        return 0;
+    }
+    return pae_enabled ? VMM_PAE_LARGE_PAGE_SIZE : VMM_LARGE_PAGE_SIZE;
+}
+
+bool vmm_map_large_page(pde_t* pd, virtual_addr_t virtual_addr, kuint32_t frame, kuint32_t flags) {
+    size_t size = vmm_large_page_size();
+    if (size == 0 || (virtual_addr & (size - 1)) || (frame & (size / PAGE_SIZE - 1))) {
+        LOG_ERR("VMM Error: Can't map a large page at 0x%x!", virtual_addr);
+        return false;
+    }
+    if (!pae_enabled && frame >= PMM_FRAMES_BELOW_4G) {
+        LOG_ERR("VMM Error: Frame 0x%x is above 4GB and PAE is off!", frame);
+        return false;
+    }
+
+    kuint32_t index;
+    generic_ptr dir = vmm_get_directory(pd, virtual_addr, &index);
+    if (!dir) {
+        return false;
+    }
+
+    // Replacing a page table would leave its frame and any stale TLB entries behind, callers fall back to 4KB pages.
+    // This is always the case in the kernel half once its tables are preallocated.
+    kuint64_t old = vmm_read_entry(dir, index);
+    if ((old & PDE_PRESENT) && !(old & PDE_PAGE_SIZE)) {
+        vmm_release(dir);
+        return false;
+    }
+
+    vmm_write_entry(dir, index, vmm_make_entry(frame, vmm_leaf_flags(flags) | PDE_PAGE_SIZE));
+    vmm_release(dir);
+    if (old & PDE_PRESENT) {
+        flush_tlb_single(virtual_addr);
+    }
+    return true;
+}
+
+// Identity maps a physical range, using large pages only where they fit inside it so nothing past the end
+// gets mapped. The rest is mapped with 4KB pages.
+static void vmm_identity_map_range(kuint64_t start, kuint64_t end, kuint32_t flags) {
+    kuint64_t large = vmm_large_page_size();
+    kuint64_t addr = start & ~(kuint64_t)(PAGE_SIZE - 1);
+    end = (end + PAGE_SIZE - 1) & ~(kuint64_t)(PAGE_SIZE - 1);
+    while (addr < end) {
+        if (large && (addr & (large - 1)) == 0 && addr + large <= end &&
+            vmm_map_large_page(page_directory, addr, addr / PAGE_SIZE, flags)) {
+            addr += large;
+            continue;
+        }
+
+        // Map 4KB pages up to the next large page boundary in one go
+        kuint64_t next = large ? (addr + large) & ~(large - 1) : end;
+        if (next > end) {
+            next = end;
+        }
+        vmm_map_range(page_directory, addr, addr / PAGE_SIZE, (next - addr) / PAGE_SIZE, flags);
+        addr = next;
+    }
+}
+
+// User directories copy the kernel's directory entries once when they are created. With a page table behind
+// every kernel half entry from the start, later kernel mappings such as heap growth land in tables all address
+// spaces share and never need to be synced. Large pages mapped before this, e.g. the framebuffer, are kept.
+static void vmm_preallocate_kernel_tables() {
+    virtual_addr_t span = 1u << vmm_directory_shift();
+    virtual_addr_t end = pae_enabled ? PAE_RECURSIVE_TABLES : VMM_RECURSIVE_TABLES;
+    kuint32_t tables = 0;
+    for (virtual_addr_t addr = KERNEL_VIRTUAL_BASE; addr < end; addr += span) {
+        kuint32_t index;
+        generic_ptr dir = vmm_get_directory(page_directory, addr, &index);
+        bool present = (vmm_read_entry(dir, index) & PDE_PRESENT) != 0;
+        vmm_release(dir);
+        if (present) {
+            continue;
+        }
+
+        generic_ptr table = vmm_get_table(page_directory, addr, true, 0);
+        if (!table) {
+            return;
+        }
+        vmm_release(table);
+        tables++;
+    }
+    LOG_DEBUG("VMM: Preallocated %d kernel page tables.", tables);
+}
+
+// The framebuffer is identity mapped, which only works as long as its physical range stays clear of the fixed
+// kernel windows. Returns the name of the first window the range runs into, or NULL.
+static const char* vmm_kernel_window_at(kuint64_t start, kuint64_t end) {
+    const struct {
+        const char* name;
+        kuint64_t start, end;
+    } windows[] = {
+        { "heap", HEAP_VIRTUAL_START, HEAP_VIRTUAL_END },
+        { "page array", PAGE_ARRAY_VIRTUAL_START, PAGE_ARRAY_VIRTUAL_START + PAGE_ARRAY_MAX_SIZE },
+        { "vmalloc", VMALLOC_VIRTUAL_START, VMALLOC_VIRTUAL_END },
+        { "kmap", KMAP_VIRTUAL_START, KMAP_VIRTUAL_START + KMAP_SLOTS * PAGE_SIZE },
+        { "recursive mapping", pae_enabled ? PAE_RECURSIVE_TABLES : VMM_RECURSIVE_TABLES, 0x100000000ULL },
+    };
+    for (kuint32_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+        if (start < windows[i].end && windows[i].start < end) {
+            return windows[i].name;
+        }
+    }
+    return NULL;
+}
+
+vmm_init_status_t vmm_init(multiboot_info_t* mbi) {
+    vmm_init_status_t status = { .is_init = false };
+    LOG_DEBUG("Setting up VMM...");
+
+    // Allocate the page directory
+    page_directory = vmm_alloc_directory();
+    if (!page_directory) {
+        LOG_ERR("VMM Error: Failed to allocate frames for paging structures.");
+        return status;
+    }
+
+    // Large pages need PSE in 32-bit mode, PAE always has them
+    kuint32_t eax, edx;
+    vmm_cpuid(1, &eax, &edx);
+    large_pages_enabled = pae_enabled || (edx & CPUID_EDX_PSE);
+    pge_supported = (edx & CPUID_EDX_PGE) != 0;
+
+    // Identity map the whole DMA zone, it holds the kernel image and the PMM bitmap
+    vmm_identity_map_range(0, PMM_ZONE_DMA_END, PTE_PRESENT | PTE_READ_WRITE);
 
     // Identity map the framebuffer memory region if available
     if (mbi && CHECK_MULTIBOOT_FLAG(mbi->flags, 12) && mbi->framebuffer_type == MULTIBOOT_FRAMEBUFFER_TYPE_RGB) {
         physical_addr_t framebuffer_start = (physical_addr_t)mbi->framebuffer_addr;
         physical_addr_t framebuffer_size = mbi->framebuffer_height * mbi->framebuffer_pitch;
-        physical_addr_t framebuffer_end = framebuffer_start + framebuffer_size;
-        
-        LOG_DEBUG("Mapping framebuffer: 0x%x - 0x%x", framebuffer_start, framebuffer_end);
+        kuint64_t framebuffer_end = (kuint64_t)framebuffer_start + framebuffer_size;
         
-        // Map each 4KB page of the framebuffer
-        for (physical_addr_t addr = framebuffer_start; addr < framebuffer_end; addr += PAGE_SIZE) {
-            vmm_identity_map_page(addr);
+        LOG_DEBUG("Mapping framebuffer: 0x%x - 0x%x", framebuffer_start, (physical_addr_t)framebuffer_end);
+        const char* window = vmm_kernel_window_at(framebuffer_start, framebuffer_end);
+        if (window) {
+            LOG_ERR("VMM Error: The framebuffer overlaps the kernel's %s window and can't be identity mapped!", window);
+            return status;
         }
+
+        // Only the visible area is mapped, the memory behind it may be RAM or another device's registers
+        vmm_identity_map_range(framebuffer_start, framebuffer_end, PTE_PRESENT | PTE_READ_WRITE);
+    }
+
+    // Map the PMM page array into its kernel window, it can be larger than the identity mapped DMA zone
+    physical_addr_t page_array_start = pmm_get_page_array_start();
+    size_t page_array_size = pmm_get_page_array_size();
+    if (page_array_size > PAGE_ARRAY_MAX_SIZE) {
+        page_array_size = PAGE_ARRAY_MAX_SIZE;
+    }
+    vmm_map_range(page_directory, PAGE_ARRAY_VIRTUAL_START, page_array_start / PAGE_SIZE,
+                  (page_array_size + PAGE_SIZE - 1) / PAGE_SIZE, PTE_PRESENT | PTE_READ_WRITE | PTE_NO_EXECUTE);
+
+    // Give every kernel half directory entry its page table now, which includes the temporary mapping window
+    vmm_preallocate_kernel_tables();
+
+    // Switch on PAE and NX before paging when they were selected
+    if (pae_enabled) {
+        enable_pae();
+        if (nx_enabled) {
+            enable_nx();
+        }
+    } else if (large_pages_enabled) {
+        enable_pse();
     }
 
     // Load the physical address of the page directory into the CR3 register
@@ -57,190 +488,765 @@ vmm_init_status_t vmm_init(multiboot_info_t* mbi) {
 
     // Enable paging by setting the PG bit in the CR0 register
     enable_paging();
+    paging_enabled = true;
+    vmm_set_global_pages(true);
+    pmm_set_page_array((pmm_page_t*)(PAGE_ARRAY_VIRTUAL_START + (page_array_start & ~PTE_FRAME)));
 
-    LOG_DEBUG("Paging enabled.");
+    zero_frame = pmm_alloc_zeroed_frame(PMM_ZONE_HIGH64);
+    if (zero_frame != PMM_NO_FRAME) {
+        pmm_frame_page(zero_frame)->flags |= PMM_PAGE_KERNEL | PMM_PAGE_LOCKED;
+    } else {
+        LOG_ERR("VMM Error: No frame for the zero page, read faults will allocate");
+    }
+
+    LOG_DEBUG("Paging enabled (%s%s%s%s).", pae_enabled ? "PAE" : "32-bit", nx_enabled ? ", NX" : "",
+              large_pages_enabled ? ", large pages" : "", pge_enabled ? ", global pages" : "");
+    status.is_init = true;
+    return status;
 }
 
-void vmm_identity_map_page(physical_addr_t physical_addr) {
-    // Decompose the physical address into a Directory and Table index, address must be aligned first
-    physical_addr_t page_addr = physical_addr & 0xFFFFF000;   // Align to 4KB boundary
-    kuint32_t pde_index = page_addr >> 22;
-    kuint32_t pte_index = (page_addr >> 12) & 0x3FF;
-
-    pde_t* pde = &page_directory[pde_index];
-    pte_t* page_table;
-
-    // If the page table for this address range isn't present, we need to create one.
-    // This involves allocating a new physical page to serve as the page table,
-    // clearing it, and then updating the Page Directory Entry (PDE) to hold
-    // the physical address of this new page table.
-    if ((*pde & PDE_PRESENT) == 0) {
-        page_table = (pte_t*)pmm_alloc_block();
-        if (!page_table) {
-            LOG_DEBUG("VMM Error: Out of memory creating new page table!");
-            return;
-        }
-        memset(page_table, 0, PAGE_SIZE);
-        *pde = (pde_t)page_table | PDE_PRESENT | PDE_READ_WRITE;
+void vmm_set_global_pages(bool enabled) {
+    if (!pge_supported) {
+        return;
+    }
+
+    // Clearing PGE also flushes the global entries from the TLB
+    if (enabled) {
+        enable_pge();
+    } else {
+        disable_pge();
+    }
+    pge_enabled = enabled;
+}
+
+bool vmm_global_pages_enabled() {
+    return pge_enabled;
+}
+
+void vmm_flush_tlb_all() {
+    // A CR3 reload keeps global entries, toggling PGE drops them as well
+    if (pge_enabled) {
+        disable_pge();
+        enable_pge();
+    } else {
+        load_page_directory((pde_t*)read_cr3());
     }
+}
 
-    // The page directory contains physical addresses. To access the page table,
-    // we need a virtual address. Since PMM allocates from low memory (which is
-    // identity-mapped), we can directly cast the physical address to a virtual one.
-    // This assumption must be revisited for a more advanced VMM.
-    page_table = (pte_t*)(*pde & PDE_FRAME);
+void vmm_identity_map_page(physical_addr_t physical_addr) {
+    // Align to 4KB boundary
+    physical_addr_t page_addr = physical_addr & PTE_FRAME;
+    generic_ptr page_table = vmm_get_table(page_directory, page_addr, true, 0);
+    if (!page_table) {
+        return;
+    }
 
     // Map the page if it's not already mapped
-    if ((page_table[pte_index] & PTE_PRESENT) == 0) {
-        page_table[pte_index] = page_addr | PTE_PRESENT | PTE_READ_WRITE;
+    kuint32_t index = vmm_table_index(page_addr);
+    if ((vmm_read_entry(page_table, index) & PTE_PRESENT) == 0) {
+        vmm_write_entry(page_table, index, vmm_make_entry(page_addr / PAGE_SIZE, vmm_leaf_flags(PTE_READ_WRITE)));
 
         // Invalidate the TLB entry for the modified page.
         flush_tlb_single(page_addr);
     }
+    vmm_release(page_table);
 }
 
-void vmm_map_page(virtual_addr_t virtual_addr, physical_addr_t physical_addr, kuint32_t flags) {
-    // Decompose the physical address into a Directory and Table index, address must be aligned first
-    virtual_addr_t aligned_addr = (virtual_addr & 0xFFFFF000);
-    kuint32_t page_directory_idx = aligned_addr >> 22;
-    kuint32_t page_table_idx = (aligned_addr >> 12) & 0x3FF;
-    
-    // Get a pointer to the page directory entry for this address
-    pde_t* page_dir = &page_directory[page_directory_idx];
-    pte_t* page_table;
-
-    // If the page table for this address range isn't present, we need to create one.
-    // This involves allocating a new physical page to serve as the page table,
-    // clearing it, and then updating the Page Directory Entry (PDE) to hold
-    // the physical address of this new page table.
-    if (!(*page_dir & PDE_PRESENT)) {
-        page_table = (pte_t*)pmm_alloc_block();
-        if(!page_table) {
-            LOG_ERR("VMM Error: Out of memory creating new page table!");
-            return;
+// Flushes a range after entries that may be cached in the TLB were changed. Past VMM_FLUSH_THRESHOLD pages one
+// full flush is cheaper than an invlpg per page. Entries that were not present are never cached.
+static void vmm_flush_range(virtual_addr_t virtual_addr, size_t count, kuint32_t stale) {
+    if (stale == 0 || !paging_enabled) {
+        return;
+    }
+    if (count > VMM_FLUSH_THRESHOLD) {
+        vmm_flush_tlb_all();
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        flush_tlb_single(virtual_addr + i * PAGE_SIZE);
+    }
+}
+
+// Maps 'count' pages starting at a page aligned address, walking each page table once and filling its entries
+// in a tight loop. Frames come from the 'frames' array, or run up from 'first_frame' when it is NULL.
+static bool vmm_fill_range(pde_t* pd, virtual_addr_t virtual_addr, const kuint32_t* frames, kuint32_t first_frame,
+                           size_t count, kuint32_t flags) {
+    kuint32_t entries = pae_enabled ? PAE_TABLE_ENTRIES : TABLE_ENTRIES;
+    kuint32_t leaf_flags = vmm_leaf_flags(flags);
+    kuint32_t stale = 0;
+    bool ok = true;
+
+    for (size_t done = 0; done < count && ok;) {
+        virtual_addr_t addr = virtual_addr + done * PAGE_SIZE;
+        generic_ptr page_table = vmm_get_table(pd, addr, true, flags);
+        if (!page_table) {
+            ok = false;
+            break;
         }
-        memset(page_table, 0, PAGE_SIZE);
-        *page_dir = (pde_t) page_table | PDE_PRESENT | PDE_READ_WRITE;
-    } else {
-        // Get the virtual address of the page table
-        page_table = (pte_t*)(*page_dir & PDE_FRAME);
+
+        kuint32_t index = vmm_table_index(addr);
+        for (; index < entries && done < count; index++, done++) {
+            kuint32_t frame = frames ? frames[done] : first_frame + done;
+            if (!pae_enabled && frame >= PMM_FRAMES_BELOW_4G) {
+                LOG_ERR("VMM Error: Frame 0x%x is above 4GB and PAE is off!", frame);
+                ok = false;
+                break;
+            }
+            if (vmm_read_entry(page_table, index) & PTE_PRESENT) {
+                stale++;
+            }
+            vmm_write_entry(page_table, index, vmm_make_entry(frame, leaf_flags));
+        }
+        vmm_release(page_table);
     }
 
-    // Create the page table entry (PTE) with the physical address and flags
-    pte_t table_entry = physical_addr | flags | PTE_PRESENT;
-    
-    // Set the page table entry
-    page_table[page_table_idx] = table_entry;
-    
-    // Invalidate the TLB entry for the virtual address
-    flush_tlb_single(aligned_addr);
+    vmm_flush_range(virtual_addr, count, stale);
+    return ok;
 }
 
-void vmm_unmap_page(virtual_addr_t virtual_addr) {
-    // Decompose the physical address into a Directory and Table index, address must be aligned first
-    virtual_addr_t aligned_addr = (virtual_addr & 0xFFFFF000);
-    kuint32_t page_directory_idx = aligned_addr >> 22;
-    kuint32_t page_table_idx = (aligned_addr >> 12) & 0x3FF;
+bool vmm_map_range(pde_t* pd, virtual_addr_t virtual_addr, kuint32_t first_frame, size_t count, kuint32_t flags) {
+    return vmm_fill_range(pd, virtual_addr & PTE_FRAME, NULL, first_frame, count, flags);
+}
+
+bool vmm_map_frames(pde_t* pd, virtual_addr_t virtual_addr, const kuint32_t* frames, size_t count, kuint32_t flags) {
+    return vmm_fill_range(pd, virtual_addr & PTE_FRAME, frames, 0, count, flags);
+}
+
+// Drops a reference on a frame, returns 1 if that was the last one and the frame went back to the allocator
+static kuint32_t vmm_put_frame(kuint32_t frame) {
+    if (frame == zero_frame) {
+        return 0;
+    }
+    pmm_page_t* page = pmm_frame_page(frame);
+    kuint32_t last = page && page->refcount == 1;
+    pmm_free_frame(frame);
+    return last;
+}
+
+// Walks the mapped entries of a range, each page table once. Entries are cleared, or rewritten with
+// 'new_flags' when 'protect' is set. Cleared entries can drop their frame's reference as well.
+static void vmm_update_range(pde_t* pd, virtual_addr_t virtual_addr, size_t count, bool protect, kuint32_t new_flags,
+                             bool free_frames) {
+    kuint32_t entries = pae_enabled ? PAE_TABLE_ENTRIES : TABLE_ENTRIES;
+    virtual_addr &= PTE_FRAME;
+    kuint32_t stale = 0;
+
+    for (size_t done = 0; done < count;) {
+        virtual_addr_t addr = virtual_addr + done * PAGE_SIZE;
+        kuint32_t index = vmm_table_index(addr);
+        generic_ptr page_table = vmm_get_table(pd, addr, false, 0);
+        if (!page_table) {
+            // Nothing is mapped up to the next table
+            done += entries - index;
+            continue;
+        }
 
+        for (; index < entries && done < count; index++, done++) {
+            kuint64_t entry = vmm_read_entry(page_table, index);
+            if (!vmm_entry_mapped(entry)) {
+                continue;
+            }
 
-    pde_t* page_dir = &page_directory[page_directory_idx];
+            if (protect) {
+                // Copy-on-write pages and the zero page stay read only until their first write
+                kuint32_t flags = new_flags;
+                if ((entry & PTE_COW) || vmm_entry_frame(entry) == zero_frame) {
+                    flags = (flags & ~PTE_READ_WRITE) | PTE_COW;
+                }
+                vmm_write_entry(page_table, index, vmm_make_entry(vmm_entry_frame(entry), vmm_leaf_flags(flags)));
+            } else {
+                vmm_write_entry(page_table, index, 0);
+                if (free_frames) {
+                    vmm_put_frame(vmm_entry_frame(entry));
+                }
+            }
+            if (entry & PTE_PRESENT) {
+                stale++;
+            }
+        }
+        vmm_release(page_table);
+    }
+
+    vmm_flush_range(virtual_addr, count, stale);
+}
+
+void vmm_unmap_range(pde_t* pd, virtual_addr_t virtual_addr, size_t count) {
+    vmm_update_range(pd, virtual_addr, count, false, 0, false);
+}
+
+void vmm_free_range(pde_t* pd, virtual_addr_t virtual_addr, size_t count) {
+    vmm_update_range(pd, virtual_addr, count, false, 0, true);
+}
+
+void vmm_protect_range(pde_t* pd, virtual_addr_t virtual_addr, size_t count, kuint32_t flags) {
+    vmm_update_range(pd, virtual_addr, count, true, flags, false);
+}
+
+void vmm_map_frame(pde_t* pd, virtual_addr_t virtual_addr, kuint32_t frame, kuint32_t flags) {
+    vmm_map_range(pd, virtual_addr, frame, 1, flags);
+}
+
+void vmm_map_page(virtual_addr_t virtual_addr, physical_addr_t physical_addr, kuint32_t flags) {
+    vmm_map_frame(page_directory, virtual_addr, physical_addr / PAGE_SIZE, flags);
+}
+
+void vmm_unmap_page(virtual_addr_t virtual_addr) {
+    virtual_addr_t aligned_addr = virtual_addr & PTE_FRAME;
 
     // Check if the page table is present
-    if(!(*page_dir & PDE_PRESENT)) {
+    generic_ptr page_table = vmm_get_table(page_directory, aligned_addr, false, 0);
+    if (!page_table) {
         LOG_ERR("VMM Error: No page found to free, returning.");
         return;
     }
 
-    // Get the virtual address of the page table so we can clear its entry
-    pte_t* page_table = (pte_t*)(*page_dir & PDE_FRAME);
-    page_table[page_table_idx] = 0;
-    
+    vmm_write_entry(page_table, vmm_table_index(aligned_addr), 0);
+    vmm_release(page_table);
+
     // Invalidate the TLB entry for the virtual address
     flush_tlb_single(aligned_addr);
 }
 
-physical_addr_t vmm_get_physical_addr(virtual_addr_t virtual_addr) {
-    // Save the offset within the page (lower 12 bits), align the address and get the indexes into PDE/PTE
-    kuint32_t offset = virtual_addr & 0xFFF;
-    kuint32_t aligned_addr = virtual_addr & 0xFFFFF000;
-    kuint32_t page_directory_idx = aligned_addr >> 22;
-    kuint32_t page_table_idx = (aligned_addr >> 12) & 0x3FF;
+// Returns the directory entry covering an address without creating or splitting anything
+static kuint64_t vmm_read_pde(pde_t* pd, virtual_addr_t virtual_addr) {
+    kuint32_t index;
+    generic_ptr dir = vmm_get_directory(pd, virtual_addr, &index);
+    if (!dir) {
+        return 0;
+    }
+    kuint64_t pde = vmm_read_entry(dir, index);
+    vmm_release(dir);
+    return pde;
+}
+
+// User mappings live in page tables whose directory entry has the user bit, the low identity map and the
+// kernel half never have it
+static bool vmm_is_user_table(kuint64_t pde) {
+    return (pde & PDE_PRESENT) && !(pde & PDE_PAGE_SIZE) && (pde & PDE_USER);
+}
 
+bool vmm_get_frame(virtual_addr_t virtual_addr, kuint32_t* frame) {
+    return vmm_get_frame_dir(page_directory, virtual_addr, frame);
+}
 
-    // Check if the page table is present
-    pde_t* page_dir = &page_directory[page_directory_idx];
-    if(!(*page_dir & PDE_PRESENT)) {
-        LOG_ERR("VMM Error: Invalid address!");
-        return 0;
+bool vmm_get_frame_dir(pde_t* pd, virtual_addr_t virtual_addr, kuint32_t* frame) {
+    // Look up large pages in the directory, asking for their table would split them
+    kuint64_t pde = vmm_read_pde(pd, virtual_addr);
+    if ((pde & PDE_PRESENT) && (pde & PDE_PAGE_SIZE)) {
+        kuint32_t entries = pae_enabled ? PAE_TABLE_ENTRIES : TABLE_ENTRIES;
+        *frame = (vmm_entry_frame(pde) & ~(entries - 1)) + ((virtual_addr >> 12) & (entries - 1));
+        return true;
     }
-    
-    // Get the virtual address of the page table and if its present
-    pte_t* page_table = (pte_t*) (*page_dir & PDE_FRAME);
-    if(!(page_table[page_table_idx] & PTE_PRESENT)) {
+
+    generic_ptr page_table = vmm_get_table(pd, virtual_addr, false, 0);
+    if (!page_table) {
+        return false;
+    }
+
+    kuint64_t entry = vmm_read_entry(page_table, vmm_table_index(virtual_addr));
+    vmm_release(page_table);
+    if (!(entry & PTE_PRESENT)) {
+        return false;
+    }
+    *frame = vmm_entry_frame(entry);
+    return true;
+}
+
+physical_addr_t vmm_get_physical_addr(virtual_addr_t virtual_addr) {
+    kuint32_t frame;
+    if (!vmm_get_frame(virtual_addr, &frame) || frame >= PMM_FRAMES_BELOW_4G) {
         LOG_ERR("VMM Error: Invalid address!");
         return 0;
     }
 
-    // Get the physical page address
-    physical_addr_t addr = page_table[page_table_idx] & PTE_FRAME;
+    // Combine the physical page address with the offset within the page
+    return frame * PAGE_SIZE | (virtual_addr & ~PTE_FRAME);
+}
+
+// The temporary mapping window has its own page table, shared by every address space. It is reached through
+// the recursive mapping of whichever directory is active.
+static generic_ptr vmm_kmap_table() {
+    return (generic_ptr)((pae_enabled ? PAE_RECURSIVE_TABLES : VMM_RECURSIVE_TABLES) +
+                         (KMAP_VIRTUAL_START >> vmm_directory_shift()) * PAGE_SIZE);
+}
+
+generic_ptr vmm_kmap(kuint32_t frame) {
+    kuint32_t flags = interrupts_save();
+    if (kmap_used == (1u << KMAP_SLOTS) - 1) {
+        interrupts_restore(flags);
+        LOG_ERR("VMM Error: No free temporary mapping slot!");
+        return NULL;
+    }
+    kuint32_t slot = __builtin_ctz(~kmap_used);
+    kmap_used |= 1u << slot;
+    interrupts_restore(flags);
+
+    virtual_addr_t addr = KMAP_VIRTUAL_START + slot * PAGE_SIZE;
+    vmm_write_entry(vmm_kmap_table(), vmm_table_index(addr), vmm_make_entry(frame, vmm_leaf_flags(PTE_READ_WRITE | PTE_NO_EXECUTE)));
+    flush_tlb_single(addr);
+    return (generic_ptr)addr;
+}
+
+void vmm_kunmap(generic_ptr addr) {
+    kuint32_t slot = ((virtual_addr_t)addr - KMAP_VIRTUAL_START) / PAGE_SIZE;
+    if ((virtual_addr_t)addr < KMAP_VIRTUAL_START || slot >= KMAP_SLOTS) {
+        LOG_ERR("VMM Error: 0x%x is not a temporary mapping!", addr);
+        return;
+    }
+
+    vmm_write_entry(vmm_kmap_table(), vmm_table_index((virtual_addr_t)addr), 0);
+    flush_tlb_single((virtual_addr_t)addr);
+
+    kuint32_t flags = interrupts_save();
+    kmap_used &= ~(1u << slot);
+    interrupts_restore(flags);
+}
 
-    // Combine the physical page address with the saved offset
-    return addr | offset;
+void vmm_zero_frame(kuint32_t frame) {
+    generic_ptr addr = vmm_access_frame(frame);
+    if (addr) {
+        memset(addr, 0, PAGE_SIZE);
+        vmm_release(addr);
+    }
 }
 
 // Creates a new user page directory, identity-maps the kernel
 pde_t* vmm_create_user_directory() {
-    // Allocate one page for the new page directory
-    pde_t* new_pd = (pde_t*)pmm_alloc_block();
+    pde_t* new_pd = vmm_alloc_directory();
     if (!new_pd) {
         LOG_ERR("VMM: Failed to allocate page directory!");
         return NULL;
     }
-    memset(new_pd, 0, PAGE_SIZE);
 
-    // Copy the kernel mappings from the global page_directory (higher-half)
-    for (int i = 0; i < 1024; i++) {
-        new_pd[i] = page_directory[i];
+    // Copy the kernel's directory entries, except for the recursive slots which have to keep pointing at the new
+    // directory itself. The kernel half tables behind them are shared, so this copy never goes stale.
+    kuint32_t directories = pae_enabled ? PAE_PDPT_ENTRIES : 1;
+    kuint32_t entry_size = pae_enabled ? sizeof(kuint64_t) : sizeof(pde_t);
+    for (kuint32_t i = 0; i < directories; i++) {
+        virtual_addr_t covered = i << 30;
+        generic_ptr dst = vmm_access_frame(vmm_directory_frame(new_pd, covered));
+        generic_ptr src = vmm_access_frame(vmm_directory_frame(page_directory, covered));
+        kuint32_t count = i + 1 < directories ? PAE_TABLE_ENTRIES : (pae_enabled ? PAE_RECURSIVE_SLOT : VMM_RECURSIVE_SLOT);
+        memcpy(dst, src, count * entry_size);
+        vmm_release(src);
+        vmm_release(dst);
     }
 
     return new_pd;
 }
 
-void vmm_map_page_dir(pde_t* pd, virtual_addr_t virtual_addr, physical_addr_t physical_addr, kuint32_t flags) {
-    virtual_addr_t aligned_addr = virtual_addr & 0xFFFFF000;
-    kuint32_t page_directory_idx = aligned_addr >> 22;
-    kuint32_t page_table_idx = (aligned_addr >> 12) & 0x3FF;
+pde_t* vmm_clone_directory(pde_t* src, vmm_vma_set_t* vmas) {
+    pde_t* dst = vmm_create_user_directory();
+    if (!dst) {
+        return NULL;
+    }
 
-    pde_t* page_dir = &pd[page_directory_idx];
-    pte_t* page_table;
+    kuint32_t entries = pae_enabled ? PAE_TABLE_ENTRIES : TABLE_ENTRIES;
+    virtual_addr_t span = 1u << vmm_directory_shift();
+    for (virtual_addr_t addr = 0; addr < KERNEL_VIRTUAL_BASE; addr += span) {
+        if (!vmm_is_user_table(vmm_read_pde(src, addr))) {
+            continue;
+        }
 
-    if (!(*page_dir & PDE_PRESENT)) {
-        page_table = (pte_t*)(pmm_alloc_block());
-        if (!page_table) {
-            LOG_ERR("VMM Error: Out of memory creating new page table!");
-            return;
+        generic_ptr dst_table = vmm_get_table(dst, addr, true, PTE_USER);
+        if (!dst_table) {
+            vmm_destroy_user_directory(dst);
+            return NULL;
         }
-        memset(page_table, 0, PAGE_SIZE);
-        *page_dir = ((physical_addr_t)page_table) | PDE_PRESENT | PDE_READ_WRITE | (flags & PTE_USER);
-    } else {
-        page_table = (pte_t*)(((*page_dir & PDE_FRAME)));
+        generic_ptr src_table = vmm_get_table(src, addr, false, 0);
+        for (kuint32_t i = 0; i < entries; i++) {
+            kuint64_t entry = vmm_read_entry(src_table, i);
+            if (!vmm_entry_mapped(entry) || !(entry & PTE_USER)) {
+                continue;
+            }
+
+            // Private pages turn read only copy-on-write in both address spaces, the first write gets its own copy.
+            // This includes pages that are read only now, a later mprotect() must not make the shared frame
+            // writable. Shared areas keep pointing at the same frames.
+            vmm_vma_t* vma = vmm_vma_find(vmas, addr + i * PAGE_SIZE);
+            bool shared = vma && (vma->prot & VMA_SHARED);
+            if (!shared) {
+                entry = (entry & ~(kuint64_t)PTE_READ_WRITE) | PTE_COW;
+                vmm_write_entry(src_table, i, entry);
+            }
+            vmm_write_entry(dst_table, i, entry);
+            if (vmm_entry_frame(entry) != zero_frame) {
+                pmm_frame_ref(vmm_entry_frame(entry));
+            }
+        }
+        vmm_release(src_table);
+        vmm_release(dst_table);
     }
 
-    page_table[page_table_idx] = physical_addr | flags | PTE_PRESENT;
-    flush_tlb_single(aligned_addr);
+    // The source may still have its pages cached as writable
+    if (vmm_is_current(src)) {
+        vmm_flush_tlb_all();
+    }
+    return dst;
+}
+
+kuint32_t vmm_destroy_user_directory(pde_t* pd) {
+    if (pd == page_directory || vmm_is_current(pd)) {
+        LOG_ERR("VMM Error: Can't destroy the kernel or the active page directory!");
+        return 0;
+    }
+
+    // Drop the references on every user frame and free the user page tables. Frames still shared copy-on-write
+    // with another address space stay with it and aren't counted as reclaimed.
+    kuint32_t reclaimed = 0;
+    kuint32_t entries = pae_enabled ? PAE_TABLE_ENTRIES : TABLE_ENTRIES;
+    virtual_addr_t span = 1u << vmm_directory_shift();
+    for (virtual_addr_t addr = 0; addr < KERNEL_VIRTUAL_BASE; addr += span) {
+        kuint64_t pde = vmm_read_pde(pd, addr);
+        if (!vmm_is_user_table(pde)) {
+            continue;
+        }
+
+        generic_ptr table = vmm_access_frame(vmm_entry_frame(pde));
+        for (kuint32_t i = 0; i < entries; i++) {
+            kuint64_t entry = vmm_read_entry(table, i);
+            if (vmm_entry_mapped(entry) && (entry & PTE_USER)) {
+                reclaimed += vmm_put_frame(vmm_entry_frame(entry));
+            }
+        }
+        vmm_release(table);
+        reclaimed += vmm_put_frame(vmm_entry_frame(pde));
+    }
+
+    // The directories go last, the kernel half tables they point at are shared and stay
+    if (pae_enabled) {
+        for (kuint32_t i = 0; i < PAE_PDPT_ENTRIES; i++) {
+            reclaimed += vmm_put_frame(vmm_directory_frame(pd, (virtual_addr_t)i << 30));
+        }
+    }
+    reclaimed += vmm_put_frame((physical_addr_t)pd / PAGE_SIZE);
+    return reclaimed;
+}
+
+void vmm_map_page_dir(pde_t* pd, virtual_addr_t virtual_addr, physical_addr_t physical_addr, kuint32_t flags) {
+    vmm_map_frame(pd, virtual_addr, physical_addr / PAGE_SIZE, flags);
 }
 
 pde_t* vmm_get_kernel_directory() {
     return page_directory;
 }
 
+// Returns the index of the first area ending above an address, which is the area containing it if there is one
+static kuint32_t vmm_vma_lower_bound(vmm_vma_set_t* set, virtual_addr_t virtual_addr) {
+    kuint32_t low = 0, high = set->count;
+    while (low < high) {
+        kuint32_t mid = (low + high) / 2;
+        if (set->vmas[mid].end <= virtual_addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+vmm_vma_t* vmm_vma_find(vmm_vma_set_t* set, virtual_addr_t virtual_addr) {
+    kuint32_t i = vmm_vma_lower_bound(set, virtual_addr);
+    if (i < set->count && set->vmas[i].start <= virtual_addr) {
+        return &set->vmas[i];
+    }
+    return NULL;
+}
+
+bool vmm_vma_insert(vmm_vma_set_t* set, virtual_addr_t virtual_addr, size_t size, kuint32_t prot, vma_backing_t backing) {
+    virtual_addr_t start = virtual_addr & PTE_FRAME;
+    virtual_addr_t end = (virtual_addr + size + PAGE_SIZE - 1) & PTE_FRAME;
+    kuint32_t i = vmm_vma_lower_bound(set, start);
+    if (end <= start || (i < set->count && set->vmas[i].start < end)) {
+        LOG_ERR("VMM Error: Area 0x%x - 0x%x overlaps an existing one!", start, end);
+        return false;
+    }
+
+    // Neighbours with the same attributes absorb the new area, e.g. when the heap grows
+    vmm_vma_t* prev = i > 0 ? &set->vmas[i - 1] : NULL;
+    vmm_vma_t* next = i < set->count ? &set->vmas[i] : NULL;
+    bool join_prev = prev && prev->end == start && prev->prot == prot && prev->backing == backing;
+    bool join_next = next && next->start == end && next->prot == prot && next->backing == backing;
+    if (join_prev && join_next) {
+        prev->end = next->end;
+        for (kuint32_t j = i; j + 1 < set->count; j++) {
+            set->vmas[j] = set->vmas[j + 1];
+        }
+        set->count--;
+        return true;
+    }
+    if (join_prev) {
+        prev->end = end;
+        return true;
+    }
+    if (join_next) {
+        next->start = start;
+        return true;
+    }
+
+    if (set->count == VMM_MAX_VMAS) {
+        LOG_ERR("VMM Error: No free area for 0x%x!", start);
+        return false;
+    }
+    for (kuint32_t j = set->count; j > i; j--) {
+        set->vmas[j] = set->vmas[j - 1];
+    }
+    set->vmas[i].start = start;
+    set->vmas[i].end = end;
+    set->vmas[i].prot = prot;
+    set->vmas[i].backing = backing;
+    set->count++;
+    return true;
+}
+
+// Makes sure an area boundary falls on an address, splitting the area containing it
+static bool vmm_vma_split(vmm_vma_set_t* set, virtual_addr_t virtual_addr) {
+    kuint32_t i = vmm_vma_lower_bound(set, virtual_addr);
+    if (i == set->count || set->vmas[i].start >= virtual_addr) {
+        return true;
+    }
+    if (set->count == VMM_MAX_VMAS) {
+        LOG_ERR("VMM Error: No free area to split 0x%x!", virtual_addr);
+        return false;
+    }
+
+    for (kuint32_t j = set->count; j > i + 1; j--) {
+        set->vmas[j] = set->vmas[j - 1];
+    }
+    set->vmas[i + 1] = set->vmas[i];
+    set->vmas[i].end = virtual_addr;
+    set->vmas[i + 1].start = virtual_addr;
+    set->count++;
+    return true;
+}
+
+// Joins neighbouring areas whose attributes match again, e.g. after a protection change
+static void vmm_vma_merge(vmm_vma_set_t* set) {
+    kuint32_t out = 0;
+    for (kuint32_t i = 1; i < set->count; i++) {
+        vmm_vma_t* last = &set->vmas[out];
+        vmm_vma_t* vma = &set->vmas[i];
+        if (last->end == vma->start && last->prot == vma->prot && last->backing == vma->backing) {
+            last->end = vma->end;
+        } else {
+            set->vmas[++out] = *vma;
+        }
+    }
+    if (set->count > 0) {
+        set->count = out + 1;
+    }
+}
+
+bool vmm_vma_remove(vmm_vma_set_t* set, virtual_addr_t virtual_addr, size_t size) {
+    virtual_addr_t start = virtual_addr & PTE_FRAME;
+    virtual_addr_t end = (virtual_addr + size + PAGE_SIZE - 1) & PTE_FRAME;
+    if (!vmm_vma_split(set, start) || !vmm_vma_split(set, end)) {
+        return false;
+    }
+
+    kuint32_t first = vmm_vma_lower_bound(set, start);
+    kuint32_t last = first;
+    while (last < set->count && set->vmas[last].start < end) {
+        last++;
+    }
+    for (kuint32_t j = last; j < set->count; j++) {
+        set->vmas[first + j - last] = set->vmas[j];
+    }
+    set->count -= last - first;
+    return true;
+}
+
+bool vmm_vma_protect(vmm_vma_set_t* set, virtual_addr_t virtual_addr, size_t size, kuint32_t prot) {
+    virtual_addr_t start = virtual_addr & PTE_FRAME;
+    virtual_addr_t end = (virtual_addr + size + PAGE_SIZE - 1) & PTE_FRAME;
+
+    // The whole range has to be covered by areas
+    virtual_addr_t covered = start;
+    for (kuint32_t i = vmm_vma_lower_bound(set, start); i < set->count && covered < end; i++) {
+        if (set->vmas[i].start > covered) {
+            break;
+        }
+        covered = set->vmas[i].end;
+    }
+    if (covered < end || !vmm_vma_split(set, start) || !vmm_vma_split(set, end)) {
+        return false;
+    }
+
+    // Only the access bits change, sharing and user access stay with the area
+    for (kuint32_t i = vmm_vma_lower_bound(set, start); i < set->count && set->vmas[i].start < end; i++) {
+        set->vmas[i].prot = (set->vmas[i].prot & ~VMA_ACCESS) | (prot & VMA_ACCESS);
+    }
+    vmm_vma_merge(set);
+    return true;
+}
+
+virtual_addr_t vmm_vma_find_free(vmm_vma_set_t* set, virtual_addr_t hint, size_t size, virtual_addr_t low,
+                                 virtual_addr_t high) {
+    size = (size + PAGE_SIZE - 1) & PTE_FRAME;
+    if (size == 0) {
+        return 0;
+    }
+
+    // The hint wins if the range it names is free
+    hint &= PTE_FRAME;
+    if (hint >= low && (kuint64_t)hint + size <= high) {
+        kuint32_t i = vmm_vma_lower_bound(set, hint);
+        if (i == set->count || set->vmas[i].start >= hint + size) {
+            return hint;
+        }
+    }
+
+    // Otherwise first fit from the bottom
+    kuint64_t candidate = low;
+    for (kuint32_t i = vmm_vma_lower_bound(set, low); i < set->count; i++) {
+        if (set->vmas[i].start >= candidate + size) {
+            break;
+        }
+        if (set->vmas[i].end > candidate) {
+            candidate = set->vmas[i].end;
+        }
+    }
+    return candidate + size <= high ? (virtual_addr_t)candidate : 0;
+}
+
+// An area without any access bit gets not present entries, which keep their frames for a later mprotect()
+kuint32_t vmm_vma_pte_flags(const vmm_vma_t* vma) {
+    kuint32_t flags = (vma->prot & VMA_ACCESS) ? PTE_PRESENT : PTE_PROT_NONE;
+    if (vma->prot & VMA_WRITE) {
+        flags |= PTE_READ_WRITE;
+    }
+    if (vma->prot & VMA_USER) {
+        flags |= PTE_USER;
+    }
+    if (!(vma->prot & VMA_EXEC)) {
+        flags |= PTE_NO_EXECUTE;
+    }
+    return flags;
+}
+
+vmm_vma_set_t* vmm_get_kernel_vmas() {
+    return &kernel_vmas;
+}
+
+// Backs a not present page inside an anonymous area with a zeroed frame. Returns false if the address is outside
+// every area or the access isn't allowed by the area, e.g. any access to a PROT_NONE area, which leaves the fault
+// fatal. Reads of private user memory
+// get the shared zero page instead, so only pages that are written take up a frame.
+static bool vmm_handle_lazy_fault(virtual_addr_t fault_addr, kuint32_t error_code) {
+    process_t* proc = proc_get_current();
+    bool kernel_half = fault_addr >= KERNEL_VIRTUAL_BASE;
+    vmm_vma_set_t* set = kernel_half ? &kernel_vmas : (proc ? &proc->vmas : NULL);
+    vmm_vma_t* vma = set ? vmm_vma_find(set, fault_addr) : NULL;
+    if (!vma || vma->backing != VMA_ANONYMOUS || !(vma->prot & VMA_ACCESS) ||
+        ((error_code & PF_WRITE) && !(vma->prot & VMA_WRITE)) ||
+        ((error_code & PF_USER) && !(vma->prot & VMA_USER))) {
+        return false;
+    }
+
+    if (!kernel_half && !(error_code & PF_WRITE) && !(vma->prot & VMA_SHARED) && zero_frame != PMM_NO_FRAME) {
+        kuint32_t flags = vmm_vma_pte_flags(vma);
+        if (flags & PTE_READ_WRITE) {
+            flags = (flags & ~PTE_READ_WRITE) | PTE_COW;
+        }
+        vmm_map_frame((pde_t*)proc->page_directory, fault_addr, zero_frame, flags);
+        fault_stats.zero_page_hits++;
+        proc->minor_faults++;
+        return true;
+    }
+
+    kuint32_t frame = pmm_alloc_zeroed_frame(PMM_ZONE_HIGH64);
+    if (frame == PMM_NO_FRAME) {
+        LOG_ERR("VMM Error: Out of memory faulting in 0x%x!", fault_addr);
+        return false;
+    }
+    pmm_frame_page(frame)->flags |= kernel_half ? PMM_PAGE_KERNEL : PMM_PAGE_ANON;
+    vmm_map_frame(kernel_half ? page_directory : (pde_t*)proc->page_directory, fault_addr, frame, vmm_vma_pte_flags(vma));
+    fault_stats.lazy_faults++;
+
+    // Kernel heap growth is shared by everybody and only shows up in the global stats, not in whatever process
+    // happens to be running
+    if (!kernel_half) {
+        proc->minor_faults++;
+    }
+    return true;
+}
+
+// Resolves a write to a copy-on-write page of the active address space. The last holder of the frame gets it
+// back writable, everybody else gets a private copy. The zero page is never copied, a fresh zeroed frame replaces it.
+static bool vmm_handle_cow_fault(virtual_addr_t fault_addr) {
+    pde_t* dir = (pde_t*)(read_cr3() & PTE_FRAME);
+    process_t* proc = proc_get_current();
+    vmm_vma_t* vma = proc ? vmm_vma_find(&proc->vmas, fault_addr) : NULL;
+    if (!vma || !(vma->prot & VMA_WRITE) || !vmm_is_user_table(vmm_read_pde(dir, fault_addr))) {
+        return false;
+    }
+
+    generic_ptr page_table = vmm_get_table(dir, fault_addr, false, 0);
+    kuint32_t index = vmm_table_index(fault_addr);
+    kuint64_t entry = vmm_read_entry(page_table, index);
+    if (!(entry & PTE_PRESENT) || !(entry & PTE_COW)) {
+        vmm_release(page_table);
+        return false;
+    }
+
+    kuint32_t frame = vmm_entry_frame(entry);
+    if (frame == zero_frame) {
+        frame = pmm_alloc_zeroed_frame(PMM_ZONE_HIGH64);
+        if (frame == PMM_NO_FRAME) {
+            LOG_ERR("VMM Error: Out of memory replacing the zero page at 0x%x!", fault_addr);
+            vmm_release(page_table);
+            return false;
+        }
+        pmm_frame_page(frame)->flags |= PMM_PAGE_ANON;
+        fault_stats.zero_page_upgrades++;
+    } else if (pmm_frame_page(frame)->refcount > 1) {
+        kuint32_t copy = pmm_alloc_frame(PMM_ZONE_HIGH64);
+        if (copy == PMM_NO_FRAME) {
+            LOG_ERR("VMM Error: Out of memory copying 0x%x on write!", fault_addr);
+            vmm_release(page_table);
+            return false;
+        }
+        generic_ptr from = vmm_kmap(frame);
+        generic_ptr to = vmm_kmap(copy);
+        memcpy(to, from, PAGE_SIZE);
+        vmm_kunmap(to);
+        vmm_kunmap(from);
+        pmm_frame_page(copy)->flags |= PMM_PAGE_ANON;
+        pmm_free_frame(frame);
+        frame = copy;
+        fault_stats.cow_copies++;
+    } else {
+        fault_stats.cow_reuses++;
+    }
+
+    kuint32_t flags = ((kuint32_t)entry & ~(PTE_FRAME | PTE_COW)) | PTE_READ_WRITE |
+                      ((entry & PAE_NO_EXECUTE) ? PTE_NO_EXECUTE : 0);
+    vmm_write_entry(page_table, index, vmm_make_entry(frame, flags));
+    vmm_release(page_table);
+    flush_tlb_single(fault_addr);
+    proc->minor_faults++;
+    return true;
+}
+
+void vmm_get_fault_stats(vmm_fault_stats_t* stats) {
+    kuint32_t flags = interrupts_save();
+    *stats = fault_stats;
+    interrupts_restore(flags);
+}
+
 void page_fault_handler(registers_t *regs){
     kuint32_t faulting_address = read_cr2();
+    if (!(regs->error_code & PF_PRESENT) && vmm_handle_lazy_fault(faulting_address, regs->error_code)) {
+        return;
+    }
+    if ((regs->error_code & PF_PRESENT) && (regs->error_code & PF_WRITE) && vmm_handle_cow_fault(faulting_address)) {
+        return;
+    }
 
     // The error code gives us details about the fault.
-    int present = !(regs->error_code & 0x1);
-    int rw = regs->error_code & 0x2;
-    int us = regs->error_code & 0x4;
+    int present = !(regs->error_code & PF_PRESENT);
+    int rw = regs->error_code & PF_WRITE;
+    int us = regs->error_code & PF_USER;
     int reserved = regs->error_code & 0x8;
     int id = regs->error_code & 0x10;
 
@@ -253,7 +1259,11 @@ void page_fault_handler(registers_t *regs){
         reserved ? "Reserved Bit Set" : "",
         id ? "Instruction Fetch" : "");
     LOG_ERR("EIP: 0x%x", regs->eip);
+    // A kernel stack that overflows into its guard page never gets here, the CPU can't push this fault's frame
+    // onto the same stack and without a double fault task gate the machine resets
+    if (vmalloc_is_guard_page(faulting_address)) {
+        LOG_ERR("The address is a vmalloc guard page, an access ran off the end of a vmalloc area");
+    }
     LOG_ERR("System Halted.");
     for(;;);
 }
-
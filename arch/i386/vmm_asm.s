@@ -2,8 +2,14 @@
 
 .global load_page_directory
 .global enable_paging
+.global enable_pae
+.global enable_nx
+.global enable_pse
+.global enable_pge
+.global disable_pge
 .global flush_tlb_single
 .global read_cr2
+.global read_cr3
 
 # Loads the physical address of the page directory into CR3
 load_page_directory:
@@ -11,13 +17,49 @@ load_page_directory:
     mov cr3, eax
     ret
 
-# Enables the paging bit (PG) in the CR0 register
+# Enables the paging bit (PG) and write protection (WP) in the CR0 register
 enable_paging:
     mov eax, cr0
-    or eax, 0x80000000   # Set the PG bit (bit 31)
+    or eax, 0x80010000   # Set the PG bit (bit 31) and WP (bit 16) so read only pages fault in ring 0 too
     mov cr0, eax
     ret
 
+# Enables Physical Address Extension by setting the PAE bit in CR4, must happen before paging is enabled
+enable_pae:
+    mov eax, cr4
+    or eax, 0x20         # Set the PAE bit (bit 5)
+    mov cr4, eax
+    ret
+
+# Enables the no-execute bit by setting NXE in the EFER MSR
+enable_nx:
+    mov ecx, 0xC0000080  # EFER
+    rdmsr
+    or eax, 0x800        # Set the NXE bit (bit 11)
+    wrmsr
+    ret
+
+# Enables 4MB pages in 32-bit paging by setting the PSE bit in CR4
+enable_pse:
+    mov eax, cr4
+    or eax, 0x10         # Set the PSE bit (bit 4)
+    mov cr4, eax
+    ret
+
+# Enables global pages by setting the PGE bit in CR4
+enable_pge:
+    mov eax, cr4
+    or eax, 0x80         # Set the PGE bit (bit 7)
+    mov cr4, eax
+    ret
+
+# Disables global pages, clearing the PGE bit flushes the whole TLB including global entries
+disable_pge:
+    mov eax, cr4
+    and eax, ~0x80       # Clear the PGE bit (bit 7)
+    mov cr4, eax
+    ret
+
 # Invalidates a single page in the TLB
 flush_tlb_single:
     mov eax, [esp + 4]    # Get the virtual address
@@ -27,4 +69,9 @@ flush_tlb_single:
 # Reads the CR2 register, which contains the faulting address on a page fault
 read_cr2:
     mov eax, cr2
+    ret
+
+# Reads the CR3 register, which holds the physical address of the active page directory
+read_cr3:
+    mov eax, cr3
     ret
\ No newline at end of file
@@ -19,23 +19,132 @@
 // Return value from pmm_find_first_free when no free blocks are found.
 #define PMM_NO_FREE_BLOCKS -1
 
+// The buddy allocator hands out naturally aligned runs of 2^order blocks, from a single block (order 0)
+// up to 1024 blocks/4MB (order 10). It manages its own arena which is carved out of the bitmap at init.
+#define PMM_BUDDY_MAX_ORDER 10
+#define PMM_BUDDY_CHUNK_BLOCKS (1 << PMM_BUDDY_MAX_ORDER)
+#define PMM_BUDDY_ARENA_MAX_CHUNKS 8        // At most 32MB of memory is reserved for the buddy arena
+#define PMM_BUDDY_ARENA_MAX_BLOCKS (PMM_BUDDY_ARENA_MAX_CHUNKS * PMM_BUDDY_CHUNK_BLOCKS)
+#define PMM_BUDDY_NONE 0xFFFFFFFF
+#define PMM_BUDDY_NO_ORDER 0xFF             // Order of the nodes inside a buddy block
+
+// Physical memory is split into zones. The DMA zone is the ISA DMA reachable memory below 16MB, which the VMM
+// also keeps identity mapped for the kernel image. Normal memory runs up to 896MB and everything above is high memory.
+// Memory above 4GB is only usable with PAE and can only be handed out by frame number.
+// Allocations prefer the highest zone they are allowed to use and fall back towards the DMA zone.
+#define PMM_ZONE_DMA_END    0x1000000
+#define PMM_ZONE_NORMAL_END 0x38000000
+#define PMM_FRAMES_BELOW_4G 0x100000
+
+typedef enum {
+    PMM_ZONE_DMA,
+    PMM_ZONE_NORMAL,
+    PMM_ZONE_HIGH,
+    PMM_ZONE_HIGH64,
+    PMM_ZONE_COUNT
+} pmm_zone_t;
+
+// Under PAE we track up to 16GB, which keeps the page array within its 64MB kernel window
+#define PMM_PAE_MAX_MEMORY 0x400000000ULL
+
+// Frame 0 sits in the reserved first megabyte, so it doubles as the "no frame" value
+#define PMM_NO_FRAME 0
+
+// Per-CPU magazines cache free blocks in front of the bitmap and move them to/from it in batches.
+#define PMM_MAX_CPUS 1
+#define PMM_MAGAZINE_SIZE 32
+#define PMM_MAGAZINE_BATCH 16
+
+// The idle task keeps a pool of zeroed frames, refilled a few frames per pass so it never holds the CPU for long.
+// Frames are zeroed through a temporary mapping, so they can come from any zone.
+#define PMM_ZERO_POOL_SIZE 64
+#define PMM_ZERO_POOL_REFILL_BATCH 4
+
 #include <kernel/multiboot.h>
 #include <libc/stdint.h>
 #include <libc/strings.h>
 
+// Every frame has a descriptor in the page array. A frame is free while its refcount is 0, the allocator
+// hands it out with a refcount of 1 and it returns to the allocator once the last reference is dropped.
+#define PMM_PAGE_RESERVED   0x01    // Never handed out by the allocator (kernel image, PMM metadata, holes)
+#define PMM_PAGE_KERNEL     0x02    // Kernel owned memory, e.g. heap frames
+#define PMM_PAGE_TABLE      0x04    // Page table or page directory
+#define PMM_PAGE_ANON       0x08    // Anonymous user memory
+#define PMM_PAGE_CACHE      0x10    // Page cache
+#define PMM_PAGE_LOCKED     0x20    // Pinned, must not be reclaimed
+#define PMM_PAGE_NONE       0xFFFFFFFF
+
+typedef struct {
+    kuint16_t refcount;
+    kuint16_t flags;
+    kuint32_t lru_next, lru_prev;   // Frame numbers of the LRU neighbours, PMM_PAGE_NONE when unlinked
+    kuint32_t private_data;         // Free for the owner of the frame
+} pmm_page_t;
+
 // Structure to hold PMM initialization information for debugging.
 typedef struct {
     kuint32_t total_memory_kb;
     kuint32_t max_blocks;
     size_t bitmap_size;
+    size_t summary_size;
     physical_addr_t kernel_start, kernel_end;
     physical_addr_t placement_address;
     kuint32_t used_blocks;
+    physical_addr_t buddy_arena_start;
+    kuint32_t buddy_arena_blocks;
+    kuint32_t zone_blocks[PMM_ZONE_COUNT];
+    kuint32_t zone_free_blocks[PMM_ZONE_COUNT];
+    physical_addr_t page_array_start;
+    size_t page_array_size;
+    kuint32_t init_us;
     bool error;
 } pmm_init_status_t;
 
+// Magazine counters summed over all CPUs, a hit is an allocation served without touching the bitmap.
+typedef struct {
+    kuint32_t hits, misses;
+    kuint32_t refills, drains;
+    kuint32_t cached_blocks;
+    kuint32_t hit_rate_pct;
+} pmm_magazine_stats_t;
+
+// Pre-zeroed pool statistics.
+typedef struct {
+    kuint32_t hits, misses;
+    kuint32_t cached_blocks;
+} pmm_zero_pool_stats_t;
+
+// Snapshot of the buddy arena, used to track fragmentation.
+typedef struct {
+    kuint32_t arena_blocks;
+    kuint32_t free_blocks;
+    kuint32_t free_per_order[PMM_BUDDY_MAX_ORDER + 1];
+    kuint32_t largest_free_order;
+    kuint32_t fragmentation_pct;    // 0 when all free memory is in the largest free run, approaches 100 as it splinters
+} pmm_buddy_stats_t;
+
 pmm_init_status_t pmm_init(multiboot_info_t *mbi);
 generic_ptr pmm_alloc_block();
 void pmm_free_block(generic_ptr p);
+generic_ptr pmm_alloc_block_zone(pmm_zone_t zone);
+kuint32_t pmm_alloc_zeroed_frame(pmm_zone_t zone);
+kuint32_t pmm_alloc_frame(pmm_zone_t zone);
+void pmm_free_frame(kuint32_t frame);
+void pmm_zero_pool_refill();
+void pmm_get_zero_pool_stats(pmm_zero_pool_stats_t *stats);
+pmm_page_t* pmm_page(physical_addr_t addr);
+pmm_page_t* pmm_frame_page(kuint32_t frame);
+void pmm_page_ref(physical_addr_t addr);
+void pmm_frame_ref(kuint32_t frame);
+physical_addr_t pmm_get_page_array_start();
+size_t pmm_get_page_array_size();
+void pmm_set_page_array(pmm_page_t *pages);
+kuint32_t pmm_get_free_blocks();
+kuint32_t pmm_get_zone_free_blocks(pmm_zone_t zone);
+void pmm_get_magazine_stats(pmm_magazine_stats_t *stats);
+
+generic_ptr pmm_alloc_blocks(kuint32_t order);
+void pmm_free_blocks(generic_ptr p, kuint32_t order);
+void pmm_get_buddy_stats(pmm_buddy_stats_t *stats);
 
 #endif // ARCH_I386_MEMORY_H
\ No newline at end of file
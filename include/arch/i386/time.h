@@ -15,6 +15,9 @@
 #define STATUS_REGISTER_B 0x0B
 #define STATUS_REGISTER_C 0x0C
 
+// The TSC is calibrated against PIT channel 2, which we can poll with interrupts disabled.
+#define TSC_CALIBRATE_MS        10
+
 #include <libc/stdint.h>
 #include <arch/i386/interrupts.h>
 
@@ -33,4 +36,9 @@ cmos_time_t time_init();
 kuint64_t time_to_unix_seconds(cmos_time_t* t);
 void rtc_handler(registers_t* regs);
 
+kuint64_t tsc_read();
+void tsc_calibrate();
+kuint32_t tsc_get_khz();
+kuint32_t tsc_cycles_to_us(kuint64_t cycles);
+
 #endif
\ No newline at end of file
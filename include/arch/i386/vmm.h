@@ -17,6 +17,10 @@
 #define PTE_CACHE_DISABLE 0x10
 #define PTE_ACCESSED    0x20
 #define PTE_DIRTY       0x40        // Page Table Entry only
+#define PTE_GLOBAL      0x100       // Kept in the TLB across CR3 reloads when CR4.PGE is set
+#define PTE_COW         0x200       // Available bit, read only page that gets copied on the first write
+#define PTE_PROT_NONE   0x400       // Available bit, not present entry that keeps the frame of a PROT_NONE page
+#define PTE_NO_EXECUTE  0x800       // Available bit, becomes the NX bit under PAE when the CPU supports it
 #define PTE_FRAME       0xFFFFF000  // Frame address mask
 
 // Page Directory Entry Flags
@@ -29,26 +33,128 @@
 #define PDE_PAGE_SIZE   0x80        // 0 for 4KB, 1 for 4MB
 #define PDE_FRAME       0xFFFFF000
 
+// A page directory entry with PDE_PAGE_SIZE set maps a whole large page instead of pointing at a page table
+#define VMM_LARGE_PAGE_SIZE     0x400000    // 4MB with PSE
+#define VMM_PAE_LARGE_PAGE_SIZE 0x200000    // 2MB under PAE
+
+// Page fault error code bits
+#define PF_PRESENT      0x01        // Set for a protection violation, clear for a not present page
+#define PF_WRITE        0x02
+#define PF_USER         0x04
+
 #define KERNEL_PDE_START    (KERNEL_VIRTUAL_BASE >> 22)
 
+// PAE uses 64 bit entries, 512 per table. A page directory pointer table with 4 entries selects the page
+// directory for each GB of the address space.
+#define PAE_TABLE_ENTRIES   512
+#define PAE_PDPT_ENTRIES    4
+#define PAE_FRAME           0x000FFFFFFFFFF000ULL
+#define PAE_NO_EXECUTE      0x8000000000000000ULL
+
+// Every page directory is mapped into its own last slot, so the page tables of the active address space show
+// up in a 4MB window at the top of memory with the directory itself in the last page. Under PAE the last
+// four entries of the last page directory map all four directories, giving an 8MB window.
+#define VMM_RECURSIVE_SLOT      1023
+#define VMM_RECURSIVE_TABLES    0xFFC00000
+#define VMM_RECURSIVE_DIRECTORY 0xFFFFF000
+#define PAE_RECURSIVE_SLOT      508
+#define PAE_RECURSIVE_TABLES    0xFF800000
+#define PAE_RECURSIVE_DIRECTORY 0xFFFFC000
+
+#define CPUID_EDX_PSE       (1 << 3)
+#define CPUID_EDX_PAE       (1 << 6)
+#define CPUID_EDX_PGE       (1 << 13)
+#define CPUID_EXT_EDX_NX    (1 << 20)
+
+// vmm_map_range()/vmm_unmap_range() flush a range page by page up to this many pages, larger ranges get one full
+// TLB flush instead
+#define VMM_FLUSH_THRESHOLD 32
+
 typedef kuint32_t pte_t;
 typedef kuint32_t pde_t;
 
+// Virtual memory areas describe the ranges of an address space. They are kept in an array sorted by address,
+// so the page fault handler finds the area of an address with a binary search.
+#define VMM_MAX_VMAS 32
+
+#define VMA_READ    0x01
+#define VMA_WRITE   0x02
+#define VMA_EXEC    0x04
+#define VMA_USER    0x08        // Accessible from ring 3
+#define VMA_SHARED  0x10        // Frames stay shared with forked children instead of being copied on write
+#define VMA_ACCESS  (VMA_READ | VMA_WRITE | VMA_EXEC)   // An area with none of these can't be touched at all
+
+typedef enum {
+    VMA_ANONYMOUS,              // Zero filled frames allocated, zeroed and mapped on first touch
+    VMA_IMAGE                   // Mapped up front from a program image, nothing to fault in
+} vma_backing_t;
+
+typedef struct {
+    virtual_addr_t start, end;  // Page aligned, end is exclusive
+    kuint32_t prot;             // VMA_* bits
+    vma_backing_t backing;
+} vmm_vma_t;
+
+typedef struct {
+    vmm_vma_t vmas[VMM_MAX_VMAS];
+    kuint32_t count;
+} vmm_vma_set_t;
+
+// Demand paging counters
+typedef struct {
+    kuint32_t lazy_faults;          // Pages backed with a fresh zeroed frame
+    kuint32_t zero_page_hits;       // Read faults served by mapping the shared zero page
+    kuint32_t zero_page_upgrades;   // Zero page mappings replaced by a private frame on the first write
+    kuint32_t cow_copies, cow_reuses;
+} vmm_fault_stats_t;
+
 typedef struct vmm_init_status {
     bool is_init;
 } vmm_init_status_t;
 
 
+bool vmm_select_paging_mode(multiboot_info_t* mbi);
+bool vmm_pae_enabled();
 vmm_init_status_t vmm_init(multiboot_info_t* mbi);
 void vmm_identity_map_page(physical_addr_t physical_addr);
 void vmm_map_page(virtual_addr_t virtual_addr, physical_addr_t physical_addr, kuint32_t flags);
+void vmm_map_frame(pde_t* pd, virtual_addr_t virtual_addr, kuint32_t frame, kuint32_t flags);
+void vmm_set_global_pages(bool enabled);
+bool vmm_global_pages_enabled();
+size_t vmm_large_page_size();
+bool vmm_map_large_page(pde_t* pd, virtual_addr_t virtual_addr, kuint32_t frame, kuint32_t flags);
 void vmm_unmap_page(virtual_addr_t virtual_addr);
+bool vmm_map_range(pde_t* pd, virtual_addr_t virtual_addr, kuint32_t first_frame, size_t count, kuint32_t flags);
+bool vmm_map_frames(pde_t* pd, virtual_addr_t virtual_addr, const kuint32_t* frames, size_t count, kuint32_t flags);
+void vmm_unmap_range(pde_t* pd, virtual_addr_t virtual_addr, size_t count);
+void vmm_free_range(pde_t* pd, virtual_addr_t virtual_addr, size_t count);
+void vmm_protect_range(pde_t* pd, virtual_addr_t virtual_addr, size_t count, kuint32_t flags);
+void vmm_flush_tlb_all();
+vmm_vma_t* vmm_vma_find(vmm_vma_set_t* set, virtual_addr_t virtual_addr);
+bool vmm_vma_insert(vmm_vma_set_t* set, virtual_addr_t virtual_addr, size_t size, kuint32_t prot, vma_backing_t backing);
+bool vmm_vma_remove(vmm_vma_set_t* set, virtual_addr_t virtual_addr, size_t size);
+bool vmm_vma_protect(vmm_vma_set_t* set, virtual_addr_t virtual_addr, size_t size, kuint32_t prot);
+virtual_addr_t vmm_vma_find_free(vmm_vma_set_t* set, virtual_addr_t hint, size_t size, virtual_addr_t low,
+                                 virtual_addr_t high);
+kuint32_t vmm_vma_pte_flags(const vmm_vma_t* vma);
+vmm_vma_set_t* vmm_get_kernel_vmas();
+bool vmm_get_frame(virtual_addr_t virtual_addr, kuint32_t* frame);
+bool vmm_get_frame_dir(pde_t* pd, virtual_addr_t virtual_addr, kuint32_t* frame);
 physical_addr_t vmm_get_physical_addr(virtual_addr_t virtual_addr);
+generic_ptr vmm_kmap(kuint32_t frame);
+void vmm_kunmap(generic_ptr addr);
+void vmm_zero_frame(kuint32_t frame);
 pde_t* vmm_get_kernel_directory();
 
 pde_t* vmm_create_user_directory();
+pde_t* vmm_clone_directory(pde_t* src, vmm_vma_set_t* vmas);
+kuint32_t vmm_destroy_user_directory(pde_t* pd);
 void vmm_map_page_dir(pde_t* pd, virtual_addr_t virtual_addr, physical_addr_t physical_addr, kuint32_t flags);
 
 void page_fault_handler(registers_t *regs);
+void vmm_get_fault_stats(vmm_fault_stats_t* stats);
+
+// Defined in vmm_asm.s, switching address spaces reloads CR3 and flushes all non-global TLB entries
+void load_page_directory(pde_t* page_directory_physical_addr);
 
 #endif //ARCH_I386_VMM_H
@@ -4,6 +4,13 @@
 #define PIT_CHANNEL_0_DATA_PORT 0x40
 #define PIT_COMMAND_PORT       0x43
 
+// Channel 2 is gated through the keyboard controller's port B, which also reports its output
+#define PIT_CHANNEL_2_DATA_PORT 0x42
+#define PIT_CHANNEL_2_GATE_PORT 0x61
+#define PIT_CHANNEL_2_GATE      0x01
+#define PIT_CHANNEL_2_SPEAKER   0x02
+#define PIT_CHANNEL_2_OUT       0x20
+
 #define PIT_MODE_3             0x06     // Square Wave Mode
 #define PIT_CHANNEL_0          0x00
 #define PIT_ACCESS_LOBYTE_HIBYTE 0x30
@@ -16,8 +16,25 @@ void debug_pic();
 void debug_idt();
 void debug_multiboot_header(multiboot_info_t *mbi);
 void debug_pmm(pmm_init_status_t *pmm_status);
+void debug_pmm_magazines();
+void debug_vmm_faults();
+void debug_vmalloc();
+bool test_pmm_buddy();
 void debug_proc_test();
+void debug_proc_reaper();
 void test_heap_allocations();
+void debug_kmem_caches();
+bool test_kmem_cache();
+bool test_vmm_vmas();
+bool test_fork_cow();
+
+#ifdef BENCHMARK
+void bench_pmm_alloc(pmm_init_status_t *pmm_status);
+void bench_context_switch();
+void bench_vmm_map();
+void bench_kmalloc();
+void bench_fork();
+#endif
 #endif
 
 #endif
\ No newline at end of file
@@ -3,26 +3,48 @@
 
 #define HEAP_MAGIC 0x12345678
 #define HEAP_MIN_SIZE 0x10000    // 64KB minimum heap size
-#define FIXED_MIN_BLOCK_SIZE
+#define HEAP_ALIGN 8             // Block sizes and payloads are 8 byte aligned
 
-#ifndef FIXED_MIN_BLOCK_SIZE
-#define MIN_BLOCK_SIZE 128
-#endif
+// Free blocks are kept on segregated free lists (TLSF). The first level picks the power of two below a block's
+// size, the second level splits that power of two into HEAP_SL_COUNT equal ranges. Blocks smaller than
+// HEAP_SMALL_BLOCK all share first level 0, where the ranges are HEAP_ALIGN bytes wide.
+#define HEAP_SL_COUNT_LOG2 4
+#define HEAP_SL_COUNT (1 << HEAP_SL_COUNT_LOG2)
+#define HEAP_FL_SHIFT (HEAP_SL_COUNT_LOG2 + 3)
+#define HEAP_SMALL_BLOCK (1 << HEAP_FL_SHIFT)
+#define HEAP_FL_COUNT (32 - HEAP_FL_SHIFT)
+#define HEAP_MAX_ALLOC 0x40000000
+
+// Once kfree() leaves a free block at least this large, the whole pages inside it go back to the PMM. They stay
+// reserved and are faulted back in when reused. A large free block at the end of the heap shrinks the heap instead.
+#define HEAP_TRIM_THRESHOLD 0x10000
 
 #include <libc/stdint.h>
 #include <kernel/kernel_layout.h>
 #include <arch/i386/vmm.h>
 
+// Block sizes are multiples of HEAP_ALIGN, which leaves the low bits of the size field for these flags
+#define HEAP_BLOCK_FREE      0x1
+#define HEAP_BLOCK_PREV_FREE 0x2     // The block before this one in memory is free, its footer holds its size
+#define HEAP_BLOCK_FLAGS     (HEAP_ALIGN - 1)
+
+// Free blocks end in a boundary tag, a copy of their size in the last word, so the block after them can find
+// their header in O(1). Used blocks don't need one, their successor knows from HEAP_BLOCK_PREV_FREE.
 typedef struct heap_block {
-    size_t size;                 // Size of the block (including this header)
-    struct heap_block* next;     // Pointer to the next block
-    struct heap_block* prev;     // Pointer to the prev block
-    int free;                    // 1 if free, 0 if used
+    size_t size;                 // Size of the block (including the header) and HEAP_BLOCK_* flags
     kuint32_t magic;             // Magic number for validation (HEAP_MAGIC)
+    // Free list links, only valid while the block is free. A used block's payload starts here.
+    struct heap_block* next_free;
+    struct heap_block* prev_free;
 } heap_block_t;
 
+#define HEAP_HEADER_SIZE __builtin_offsetof(heap_block_t, next_free)
+#define HEAP_MIN_BLOCK_SIZE ((sizeof(heap_block_t) + sizeof(size_t) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+
 void heap_init(virtual_addr_t start, size_t size);
 generic_ptr kmalloc(size_t size);
+generic_ptr kmalloc_aligned(size_t size, size_t align);
+generic_ptr kcalloc(size_t count, size_t size);
 void kfree(generic_ptr ptr);
 generic_ptr krealloc(generic_ptr ptr, size_t size);
 bool heap_expand(size_t additional_size);
@@ -30,5 +52,6 @@ bool heap_expand(size_t additional_size);
 size_t heap_get_total_size();
 size_t heap_get_free_size();
 size_t heap_get_used_size();
+kuint32_t heap_get_trimmed_pages();
 
-#endif
\ No newline at end of file
+#endif
@@ -9,6 +9,19 @@
 // Heap memory layout
 #define HEAP_VIRTUAL_START      0xD0000000  // 3.25GB - Start of kernel heap
 #define HEAP_SIZE               0x100000    // 1MB heap size
+#define HEAP_VIRTUAL_END        0xE0000000  // The heap may grow up to the page array, never into it
+
+// PMM page array, one 16 byte descriptor per 4KB frame covers up to 16GB
+#define PAGE_ARRAY_VIRTUAL_START 0xE0000000
+#define PAGE_ARRAY_MAX_SIZE     0x4000000   // 64MB
+
+// vmalloc() maps scattered frames into contiguous kernel addresses here, right after the page array
+#define VMALLOC_VIRTUAL_START   0xE4000000
+#define VMALLOC_VIRTUAL_END     0xF0000000  // 192MB, up to the kmap slots
+
+// Temporary mappings for frames the kernel can't reach otherwise, e.g. above 4GB under PAE
+#define KMAP_VIRTUAL_START      0xF0000000
+#define KMAP_SLOTS              16
 
 // Other kernel memory regions
 #define KERNEL_STACK_SIZE       0x4000      // 16KB kernel stack
@@ -12,6 +12,19 @@
 
 #define MAX_OPEN_FILES 128   // Total number of file handles (io, drivers, etc) a process can have
 
+// Exited processes stay in their slot until the idle task reaps them, a few per pass. Their kernel stacks are
+// kept in a small cache for the next process instead of going back to the heap.
+#define PROC_REAP_BATCH         4
+#define PROC_KSTACK_CACHE_SIZE  8
+
+// User programs are loaded at a fixed address, their stack is reserved lazily right above
+#define USER_CODE_VIRTUAL_START  0x1000000
+#define USER_STACK_VIRTUAL_START 0x1080000
+#define USER_STACK_SIZE          0x10000    // 64KB, only touched pages get a frame
+
+// mmap() places mappings without a usable hint from here up to the kernel half
+#define USER_MMAP_VIRTUAL_START  0x10000000
+
 #include <libc/stdint.h>
 #include <arch/i386/interrupts.h>
 #include <arch/i386/vmm.h>
@@ -34,15 +47,32 @@ typedef struct process {
     bool used;
     proc_type_t proc_type;
     file_node_t* open_files[MAX_OPEN_FILES];
+    vmm_vma_set_t vmas;             // User areas of the address space
+    kuint32_t minor_faults;         // Pages faulted in or copied on write
 } process_t;
 
 typedef void (*proc_entry_point_t)(void);
 
+// Reaper counters, pages_reclaimed only counts frames that went back to the PMM
+typedef struct {
+    kuint32_t zombies;
+    kuint32_t reaped;
+    kuint32_t pages_reclaimed;
+    kuint32_t stack_cache_hits, stack_cache_misses;
+    kuint32_t cached_stacks;
+} proc_reaper_stats_t;
+
 int proc_init();
 
 process_t* proc_create(proc_entry_point_t entry_point, bool restore_interrupts);
+process_t* proc_create_user(unsigned char* user_code, size_t user_size, bool restore_interrupts);
+process_t* proc_clone(process_t* parent, registers_t* regs);
+void proc_destroy(process_t* proc);
 process_t* proc_get_current();
+process_t* proc_enter(process_t* proc);
 void proc_terminate(process_t* proc);
+kuint32_t proc_reap();
+void proc_get_reaper_stats(proc_reaper_stats_t* stats);
 
 void create_user_process();
 void create_user_process_syscall_exit();
@@ -0,0 +1,62 @@
+#ifndef KERNEL_SLAB_H
+#define KERNEL_SLAB_H
+
+// Object caches for fixed size kernel objects. Each cache carves page sized slabs into equal objects and keeps
+// its slabs on partial/full/empty lists, so an allocation is a pop from the first partial slab's free list.
+#define KMEM_MAX_CACHES         32
+#define KMEM_MAX_OBJECT_SIZE    (PAGE_SIZE / 4)    // Keeps at least 3 objects and little waste per slab
+#define KMEM_MIN_ALIGN          4
+#define KMEM_MAX_EMPTY_SLABS    1                  // Empty slabs kept per cache before pages go back to the PMM
+#define KMEM_SLAB_MAGIC         0x51AB51AB
+#define KMEM_FREE_END           0xFFFF
+
+#include <libc/stdint.h>
+#include <kernel/kernel_layout.h>
+#include <arch/i386/vmm.h>
+
+// Runs once per object when its slab is created. Objects must be freed back in their constructed state, so a
+// constructed object is never set up again while it moves between kmem_cache_alloc() and kmem_cache_free().
+typedef void (*kmem_ctor_t)(generic_ptr object);
+
+// Sits at the start of its page, followed by the free list links and then the objects
+typedef struct kmem_slab {
+    kuint32_t magic;
+    struct kmem_cache* cache;
+    struct kmem_slab *next, *prev;
+    generic_ptr objects;
+    kuint16_t in_use;
+    kuint16_t free_head;            // Index of the first free object, KMEM_FREE_END when the slab is full
+    kuint16_t next_free[];          // Free list links by object index, kept out of the objects for the constructor
+} kmem_slab_t;
+
+typedef struct kmem_cache {
+    const char* name;
+    size_t object_size;
+    size_t align;
+    size_t stride;                  // Object size rounded up to the alignment
+    kuint32_t objects_per_slab;
+    kmem_ctor_t ctor;
+    kmem_slab_t *partial, *full, *empty;
+    kuint32_t slabs, empty_slabs;
+    kuint32_t active_objects;
+    bool used;
+} kmem_cache_t;
+
+typedef struct {
+    const char* name;
+    size_t object_size;
+    kuint32_t slabs;
+    kuint32_t objects_per_slab;
+    kuint32_t active_objects, total_objects;
+    kuint32_t occupancy_pct;
+} kmem_cache_stats_t;
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor);
+bool kmem_cache_destroy(kmem_cache_t* cache);
+generic_ptr kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, generic_ptr object);
+void kmem_cache_shrink(kmem_cache_t* cache);
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats);
+kuint32_t kmem_get_all_stats(kmem_cache_stats_t* stats, kuint32_t max);
+
+#endif
@@ -11,4 +11,7 @@ typedef volatile kuint32_t spinlock_t;
 void spinlock_acquire(spinlock_t* lock);
 void spinlock_release(spinlock_t* lock);
 
+kuint32_t interrupts_save();
+void interrupts_restore(kuint32_t flags);
+
 #endif
\ No newline at end of file
@@ -6,8 +6,13 @@
 void syscall_handler(registers_t *regs);
 void sys_yield(registers_t *regs);
 void sys_exit(registers_t *regs);
+void sys_fork(registers_t *regs);
 void sys_pid(registers_t *regs);
 
 void sys_vfs_write(registers_t *regs);
 
+void sys_mmap(registers_t *regs);
+void sys_munmap(registers_t *regs);
+void sys_mprotect(registers_t *regs);
+
 #endif
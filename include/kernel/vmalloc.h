@@ -0,0 +1,29 @@
+#ifndef KERNEL_VMALLOC_H
+#define KERNEL_VMALLOC_H
+
+// Every area is preceded by an unmapped guard page, so running off either end of an area faults instead of
+// silently corrupting its neighbour. Kernel stacks grow down into the guard page below them.
+#define VMALLOC_GUARD_SIZE  0x1000
+#define VMALLOC_MAX_AREAS   1280        // Enough for a kernel stack per process plus large buffers
+#define VMALLOC_MAP_BATCH   16          // Frames allocated and mapped per vmm_map_frames() call
+
+#include <libc/stdint.h>
+#include <kernel/kernel_layout.h>
+
+typedef struct {
+    virtual_addr_t base;                // Address of the guard page, the area starts right after it
+    kuint32_t pages;                    // Mapped pages, not counting the guard page
+} vmalloc_area_t;
+
+typedef struct {
+    kuint32_t areas;
+    kuint32_t mapped_pages;
+    size_t free_size;                   // Unreserved address space left in the region
+} vmalloc_stats_t;
+
+generic_ptr vmalloc(size_t size);
+void vfree(generic_ptr ptr);
+bool vmalloc_is_guard_page(virtual_addr_t virtual_addr);
+void vmalloc_get_stats(vmalloc_stats_t* stats);
+
+#endif
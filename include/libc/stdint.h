@@ -3,13 +3,13 @@
 #define KERNEL_STD_INT_H
 
 // Unsigned
-typedef unsigned long  kuint64_t;
+typedef unsigned long long kuint64_t;
 typedef unsigned int   kuint32_t;
 typedef unsigned short kuint16_t;
 typedef unsigned char  kuint8_t;
 
 // Signed
-typedef long    kint64_t;
+typedef long long kint64_t;
 typedef int     kint32_t;
 typedef short   kint16_t;
 typedef char    kint8_t;
@@ -13,7 +13,7 @@
 
 void proc_yield();
 void proc_exit(int status);
-void proc_fork();
+kint32_t proc_fork();
 void proc_wait();
 void proc_wait_pid();
 kuint32_t proc_pid();
@@ -24,4 +24,26 @@ kuint32_t proc_pid();
 
 kint32_t vfs_write(kuint32_t fd, const char* buf, size_t count);
 
+
+// --- Memory Syscalls ---
+#define SYSCALL_MEM_MMAP        70
+#define SYSCALL_MEM_MUNMAP      71
+#define SYSCALL_MEM_MPROTECT    72
+
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_PRIVATE     0x01    // Copied on write after fork
+#define MAP_SHARED      0x02    // Shared with forked children
+#define MAP_FIXED       0x10    // Use the address as is instead of as a hint
+#define MAP_ANONYMOUS   0x20    // Only anonymous memory is supported, the flag is accepted for portability
+
+#define MAP_FAILED      ((generic_ptr)-1)
+
+generic_ptr mmap(generic_ptr addr, size_t length, kuint32_t prot, kuint32_t flags);
+kint32_t munmap(generic_ptr addr, size_t length);
+kint32_t mprotect(generic_ptr addr, size_t length, kuint32_t prot);
+
 #endif
@@ -1,8 +1,14 @@
 #include <kernel/debug.h>
 #include <kernel/proc.h>
 #include <kernel/heap.h>
+#include <kernel/vmalloc.h>
+#include <kernel/slab.h>
+#include <kernel/syscall.h>
+#include <libc/sysstd.h>
 #include <drivers/terminal.h>
 #include <arch/i386/gdt.h>
+#include <arch/i386/time.h>
+#include <kernel/sync.h>
 
 #ifdef DEBUG
 
@@ -24,6 +30,14 @@ void test_proc_2() {
     }
 }
 
+void debug_proc_reaper() {
+    proc_reaper_stats_t stats;
+    proc_get_reaper_stats(&stats);
+    LOG_INFO("PROC reaper - Zombies: %d, Reaped: %d, Pages reclaimed: %d, Stack cache hits: %d, Misses: %d, Cached: %d\n",
+             stats.zombies, stats.reaped, stats.pages_reclaimed, stats.stack_cache_hits, stats.stack_cache_misses,
+             stats.cached_stacks);
+}
+
 void debug_proc_test() {
     LOG_DEBUG("Initializing scheduler test...");
     if(proc_init() == 0) {
@@ -168,6 +182,391 @@ void debug_pmm(pmm_init_status_t *pmm_status) {
     LOG_DEBUG("Kernel ends at: 0x%x\n", pmm_status->kernel_end);
     LOG_DEBUG("Placing bitmap at: 0x%x\n", pmm_status->placement_address);
     LOG_DEBUG("%d blocks used initially.\n", pmm_status->used_blocks);
+    LOG_DEBUG("Page array at: 0x%x (%d bytes)\n", pmm_status->page_array_start, pmm_status->page_array_size);
+    LOG_DEBUG("Initialized in %d us\n", pmm_status->init_us);
+    LOG_DEBUG("Buddy arena at: 0x%x (%d blocks)\n", pmm_status->buddy_arena_start, pmm_status->buddy_arena_blocks);
+
+    const char* zone_names[PMM_ZONE_COUNT] = { "DMA", "Normal", "High", "High64" };
+    for (kuint32_t z = 0; z < PMM_ZONE_COUNT; z++) {
+        LOG_DEBUG("Zone %s: %d blocks, %d free\n", zone_names[z], pmm_status->zone_blocks[z], pmm_status->zone_free_blocks[z]);
+    }
+}
+
+void debug_pmm_magazines() {
+    pmm_magazine_stats_t stats;
+    pmm_get_magazine_stats(&stats);
+    LOG_INFO("PMM magazines - Hits: %d, Misses: %d, Hit rate: %d%%, Refills: %d, Drains: %d, Cached: %d blocks\n",
+             stats.hits, stats.misses, stats.hit_rate_pct, stats.refills, stats.drains, stats.cached_blocks);
+
+    pmm_zero_pool_stats_t zero_stats;
+    pmm_get_zero_pool_stats(&zero_stats);
+    LOG_INFO("PMM zero pool - Hits: %d, Misses: %d, Cached: %d blocks\n",
+             zero_stats.hits, zero_stats.misses, zero_stats.cached_blocks);
+}
+
+void debug_vmm_faults() {
+    vmm_fault_stats_t stats;
+    vmm_get_fault_stats(&stats);
+    LOG_INFO("VMM faults - Lazy: %d, Zero page hits: %d, Zero page upgrades: %d, COW copies: %d, COW reuses: %d\n",
+             stats.lazy_faults, stats.zero_page_hits, stats.zero_page_upgrades, stats.cow_copies, stats.cow_reuses);
+}
+
+void debug_vmalloc() {
+    vmalloc_stats_t stats;
+    vmalloc_get_stats(&stats);
+    LOG_INFO("vmalloc - Areas: %d, Mapped: %d pages, Free: %d KB\n", stats.areas, stats.mapped_pages,
+             stats.free_size / 1024);
+}
+
+static void debug_buddy_stats(const char* stage) {
+    pmm_buddy_stats_t stats;
+    pmm_get_buddy_stats(&stats);
+    LOG_INFO("%s - Free: %d/%d blocks, Largest order: %d, Fragmentation: %d%%\n",
+             stage, stats.free_blocks, stats.arena_blocks, stats.largest_free_order, stats.fragmentation_pct);
+}
+
+bool test_pmm_buddy() {
+    LOG_INFO("Testing buddy allocator...\n");
+
+    pmm_buddy_stats_t initial;
+    pmm_get_buddy_stats(&initial);
+    if (initial.arena_blocks == 0) {
+        LOG_WARN("No buddy arena available, skipping test\n");
+        return true;
+    }
+    debug_buddy_stats("Initial");
+
+    // Allocate a block of every order and make sure each comes back naturally aligned
+    generic_ptr blocks[PMM_BUDDY_MAX_ORDER + 1];
+    bool ok = true;
+    for (kuint32_t order = 0; order <= PMM_BUDDY_MAX_ORDER; order++) {
+        blocks[order] = pmm_alloc_blocks(order);
+        if (blocks[order] && ((physical_addr_t)blocks[order] % (PMM_BLOCK_SIZE << order)) != 0) {
+            LOG_ERR("Order %d block 0x%x is not naturally aligned!\n", order, blocks[order]);
+            ok = false;
+        }
+    }
+    debug_buddy_stats("After one block per order");
+
+    // No two of those blocks may overlap
+    for (kuint32_t a = 0; a <= PMM_BUDDY_MAX_ORDER; a++) {
+        for (kuint32_t b = a + 1; b <= PMM_BUDDY_MAX_ORDER; b++) {
+            physical_addr_t a_start = (physical_addr_t)blocks[a], b_start = (physical_addr_t)blocks[b];
+            if (a_start && b_start && a_start < b_start + (PMM_BLOCK_SIZE << b) && b_start < a_start + (PMM_BLOCK_SIZE << a)) {
+                LOG_ERR("Order %d and order %d blocks overlap!\n", a, b);
+                ok = false;
+            }
+        }
+    }
+    for (kuint32_t order = 0; order <= PMM_BUDDY_MAX_ORDER; order++) {
+        if (blocks[order]) pmm_free_blocks(blocks[order], order);
+    }
+
+    // Fragment the arena with single blocks, free every other one and check that nothing coalesces
+    // until the rest are returned
+    generic_ptr singles[64];
+    for (int i = 0; i < 64; i++) {
+        singles[i] = pmm_alloc_blocks(0);
+    }
+    for (int i = 0; i < 64; i += 2) {
+        if (singles[i]) pmm_free_blocks(singles[i], 0);
+    }
+    debug_buddy_stats("After freeing every other single block");
+    pmm_buddy_stats_t fragmented;
+    pmm_get_buddy_stats(&fragmented);
+    if (fragmented.free_per_order[0] < 32) {
+        LOG_ERR("Expected at least 32 unmerged single blocks, found %d\n", fragmented.free_per_order[0]);
+        ok = false;
+    }
+    for (int i = 1; i < 64; i += 2) {
+        if (singles[i]) pmm_free_blocks(singles[i], 0);
+    }
+
+    // Frees with the wrong order or from the middle of a block must be rejected and change nothing
+    generic_ptr quad = pmm_alloc_blocks(2);
+    if (quad) {
+        pmm_buddy_stats_t before;
+        pmm_get_buddy_stats(&before);
+        pmm_free_blocks(quad, 3);
+        pmm_free_blocks(quad, 1);
+        pmm_free_blocks((generic_ptr)((physical_addr_t)quad + PMM_BLOCK_SIZE), 0);
+        pmm_buddy_stats_t after;
+        pmm_get_buddy_stats(&after);
+        if (after.free_blocks != before.free_blocks) {
+            LOG_ERR("Mismatched buddy frees changed the free block count from %d to %d!\n", before.free_blocks, after.free_blocks);
+            ok = false;
+        }
+        pmm_free_blocks(quad, 2);
+    }
+
+    // Everything should have merged back into the original max order blocks
+    pmm_buddy_stats_t final;
+    pmm_get_buddy_stats(&final);
+    debug_buddy_stats("After freeing everything");
+    if (final.free_blocks != initial.free_blocks || final.fragmentation_pct != initial.fragmentation_pct) {
+        LOG_ERR("Buddy arena did not coalesce back to its initial state!\n");
+        ok = false;
+    }
+
+    if (ok) {
+        LOG_INFO("Buddy allocator testing completed!\n");
+    } else {
+        LOG_ERR("Buddy allocator testing failed!\n");
+    }
+    return ok;
+}
+
+void debug_kmem_caches() {
+    kmem_cache_stats_t stats[KMEM_MAX_CACHES];
+    kuint32_t count = kmem_get_all_stats(stats, KMEM_MAX_CACHES);
+    for (kuint32_t i = 0; i < count; i++) {
+        LOG_INFO("KMEM cache %s - Object: %d bytes, Slabs: %d, Objects: %d/%d (%d%%)\n", stats[i].name,
+                 stats[i].object_size, stats[i].slabs, stats[i].active_objects, stats[i].total_objects,
+                 stats[i].occupancy_pct);
+    }
+}
+
+#define TEST_KMEM_SLABS 3
+#define TEST_KMEM_PATTERN 0xC0FFEE00
+
+static void test_kmem_ctor(generic_ptr object) {
+    *(kuint32_t*)object = TEST_KMEM_PATTERN;
+}
+
+bool test_kmem_cache() {
+    LOG_INFO("Testing slab caches...\n");
+
+    kuint32_t free_before = pmm_get_free_blocks();
+    kmem_cache_t* cache = kmem_cache_create("test", 60, 16, test_kmem_ctor);
+    if (!cache) {
+        LOG_ERR("Failed to create the test cache\n");
+        return false;
+    }
+
+    // Fill a few slabs, every object must be aligned and come out of the constructor
+    kuint32_t* objects[TEST_KMEM_SLABS * PAGE_SIZE / 64];
+    kuint32_t count = cache->objects_per_slab * TEST_KMEM_SLABS;
+    bool ok = true;
+    for (kuint32_t i = 0; i < count; i++) {
+        objects[i] = kmem_cache_alloc(cache);
+        if (!objects[i] || ((virtual_addr_t)objects[i] & 15) || *objects[i] != TEST_KMEM_PATTERN) {
+            LOG_ERR("Object %d at 0x%x is missing, misaligned or unconstructed!\n", i, objects[i]);
+            ok = false;
+            count = i;
+            break;
+        }
+    }
+    debug_kmem_caches();
+
+    kmem_cache_stats_t stats;
+    kmem_cache_get_stats(cache, &stats);
+    if (ok && (stats.slabs != TEST_KMEM_SLABS || stats.occupancy_pct != 100)) {
+        LOG_ERR("Expected %d full slabs, found %d at %d%%\n", TEST_KMEM_SLABS, stats.slabs, stats.occupancy_pct);
+        ok = false;
+    }
+
+    // Freed objects are reused before the cache grows, and keep their constructed state
+    kmem_cache_free(cache, objects[0]);
+    kuint32_t* reused = kmem_cache_alloc(cache);
+    if (reused != objects[0] || *reused != TEST_KMEM_PATTERN) {
+        LOG_ERR("Freed object 0x%x was not reused, got 0x%x\n", objects[0], reused);
+        ok = false;
+    }
+
+    for (kuint32_t i = 0; i < count; i++) {
+        kmem_cache_free(cache, objects[i]);
+    }
+    kmem_cache_get_stats(cache, &stats);
+    if (stats.active_objects != 0 || stats.slabs > KMEM_MAX_EMPTY_SLABS) {
+        LOG_ERR("Cache kept %d objects in %d slabs after freeing everything\n", stats.active_objects, stats.slabs);
+        ok = false;
+    }
+    if (!kmem_cache_destroy(cache) || pmm_get_free_blocks() != free_before) {
+        LOG_ERR("Slab cache leaked %d blocks!\n", free_before - pmm_get_free_blocks());
+        ok = false;
+    }
+
+    if (ok) {
+        LOG_INFO("Slab cache testing completed!\n");
+    } else {
+        LOG_ERR("Slab cache testing failed!\n");
+    }
+    return ok;
+}
+
+#define TEST_VMA_BASE 0x10000000
+#define TEST_VMA_RW (VMA_READ | VMA_WRITE | VMA_USER)
+#define TEST_VMA_RO (VMA_READ | VMA_USER)
+
+// Checks the areas of a set against pairs of start and end offsets from TEST_VMA_BASE, in pages
+static bool test_vma_layout(vmm_vma_set_t* set, const char* stage, kuint32_t count, const kuint32_t* pages) {
+    bool ok = set->count == count;
+    for (kuint32_t i = 0; ok && i < count; i++) {
+        ok = set->vmas[i].start == TEST_VMA_BASE + pages[2 * i] * PAGE_SIZE &&
+             set->vmas[i].end == TEST_VMA_BASE + pages[2 * i + 1] * PAGE_SIZE;
+    }
+    if (!ok) {
+        LOG_ERR("%s: expected %d areas, found %d starting at 0x%x\n", stage, count, set->count,
+                set->count ? set->vmas[0].start : 0);
+    }
+    return ok;
+}
+
+static kuint32_t test_mem_syscall(void (*syscall)(registers_t*), kuint32_t ebx, kuint32_t ecx, kuint32_t edx,
+                                  kuint32_t esi) {
+    registers_t regs;
+    memset(&regs, 0, sizeof(regs));
+    regs.ebx = ebx;
+    regs.ecx = ecx;
+    regs.edx = edx;
+    regs.esi = esi;
+    syscall(&regs);
+    return regs.eax;
+}
+
+// Runs mprotect() from inside a user process. PROT_NONE pages must lose their present bit but keep their frame,
+// and a private page that was read only when the process forked must still be copied once the child makes it
+// writable again.
+static bool test_vmm_mprotect() {
+    static unsigned char program[] = { 0xEB, 0xFE };   // jmp $
+    kuint32_t flags = interrupts_save();
+    process_t* proc = proc_create_user(program, sizeof(program), false);
+    if (!proc) {
+        LOG_ERR("Failed to create the mprotect test process\n");
+        interrupts_restore(flags);
+        return false;
+    }
+    proc->current_state = STOPPED;
+    pde_t* pd = (pde_t*)proc->page_directory;
+    process_t* self = proc_enter(proc);
+    bool ok = true;
+
+    // A present page goes away under PROT_NONE and comes back with the same frame and contents
+    virtual_addr_t addr = test_mem_syscall(sys_mmap, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+    virtual_addr_t readonly = test_mem_syscall(sys_mmap, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+    if (addr == (virtual_addr_t)MAP_FAILED || readonly == (virtual_addr_t)MAP_FAILED) {
+        LOG_ERR("mmap failed in the mprotect test\n");
+        proc_enter(self);
+        proc_destroy(proc);
+        interrupts_restore(flags);
+        return false;
+    }
+    volatile kuint32_t* page = (volatile kuint32_t*)addr;
+    kuint32_t frame = 0, restored = 0;
+
+    // Reading the untouched page maps the zero page, the first write replaces it with a frame of its own
+    vmm_fault_stats_t before, after;
+    vmm_get_fault_stats(&before);
+    kuint32_t untouched = *page;
+    *page = 0x5A5A5A5A;
+    vmm_get_fault_stats(&after);
+    if (untouched != 0 || after.zero_page_hits != before.zero_page_hits + 1 ||
+        after.zero_page_upgrades != before.zero_page_upgrades + 1) {
+        LOG_ERR("Untouched page read 0x%x, %d zero page hits and %d upgrades\n", untouched,
+                after.zero_page_hits - before.zero_page_hits, after.zero_page_upgrades - before.zero_page_upgrades);
+        ok = false;
+    }
+    vmm_get_frame_dir(pd, addr, &frame);
+    test_mem_syscall(sys_mprotect, addr, PAGE_SIZE, PROT_NONE, 0);
+    if (vmm_get_frame_dir(pd, addr, &restored)) {
+        LOG_ERR("PROT_NONE page 0x%x is still present\n", addr);
+        ok = false;
+    }
+    test_mem_syscall(sys_mprotect, addr, PAGE_SIZE, PROT_READ, 0);
+    if (!vmm_get_frame_dir(pd, addr, &restored) || restored != frame || *page != 0x5A5A5A5A) {
+        LOG_ERR("PROT_READ brought back frame 0x%x instead of 0x%x\n", restored, frame);
+        ok = false;
+    }
+
+    // Unmapping a PROT_NONE page still drops its frame
+    test_mem_syscall(sys_mprotect, addr, PAGE_SIZE, PROT_NONE, 0);
+    pmm_page_t* frame_page = pmm_frame_page(frame);
+    test_mem_syscall(sys_munmap, addr, PAGE_SIZE, 0, 0);
+    if (frame_page->refcount != 0) {
+        LOG_ERR("Unmapped PROT_NONE frame 0x%x still has %d references\n", frame, frame_page->refcount);
+        ok = false;
+    }
+
+    // An untouched PROT_NONE area is never faulted in
+    addr = test_mem_syscall(sys_mmap, 0, PAGE_SIZE, PROT_NONE, MAP_PRIVATE);
+    vmm_vma_t* none = vmm_vma_find(&proc->vmas, addr);
+    if (!none || (vmm_vma_pte_flags(none) & PTE_PRESENT)) {
+        LOG_ERR("PROT_NONE area at 0x%x would be mapped present\n", addr);
+        ok = false;
+    }
+
+    // Make a written page read only, fork, and make it writable again in the child only
+    page = (volatile kuint32_t*)readonly;
+    *page = 0x11111111;
+    test_mem_syscall(sys_mprotect, readonly, PAGE_SIZE, PROT_READ, 0);
+    registers_t regs;
+    memset(&regs, 0, sizeof(regs));
+    process_t* child = proc_clone(proc, &regs);
+    if (child) {
+        child->current_state = STOPPED;
+        proc_enter(child);
+        test_mem_syscall(sys_mprotect, readonly, PAGE_SIZE, PROT_READ | PROT_WRITE, 0);
+        *page = 0x22222222;
+        proc_enter(proc);
+        kuint32_t parent_frame = 0, child_frame = 0;
+        vmm_get_frame_dir(pd, readonly, &parent_frame);
+        vmm_get_frame_dir((pde_t*)child->page_directory, readonly, &child_frame);
+        if (*page != 0x11111111 || parent_frame == child_frame) {
+            LOG_ERR("The child's write reached the parent: 0x%x, frames 0x%x and 0x%x\n", *page, parent_frame,
+                    child_frame);
+            ok = false;
+        }
+    }
+
+    proc_enter(self);
+    if (child) {
+        proc_destroy(child);
+    }
+    proc_destroy(proc);
+    interrupts_restore(flags);
+    return ok;
+}
+
+bool test_vmm_vmas() {
+    LOG_INFO("Testing virtual memory areas...\n");
+    vmm_vma_set_t set = { .count = 0 };
+    bool ok = true;
+
+    // Touching areas with the same rights merge, an overlap is rejected
+    vmm_vma_insert(&set, TEST_VMA_BASE, 2 * PAGE_SIZE, TEST_VMA_RW, VMA_ANONYMOUS);
+    vmm_vma_insert(&set, TEST_VMA_BASE + 4 * PAGE_SIZE, 2 * PAGE_SIZE, TEST_VMA_RW, VMA_ANONYMOUS);
+    ok &= test_vma_layout(&set, "Two areas", 2, (const kuint32_t[]){ 0, 2, 4, 6 });
+    ok &= !vmm_vma_insert(&set, TEST_VMA_BASE + PAGE_SIZE, 2 * PAGE_SIZE, TEST_VMA_RW, VMA_ANONYMOUS);
+    vmm_vma_insert(&set, TEST_VMA_BASE + 2 * PAGE_SIZE, 2 * PAGE_SIZE, TEST_VMA_RW, VMA_ANONYMOUS);
+    ok &= test_vma_layout(&set, "Gap filled", 1, (const kuint32_t[]){ 0, 6 });
+
+    // Protecting the middle splits the area in three, restoring the rights merges it again
+    ok &= vmm_vma_protect(&set, TEST_VMA_BASE + 2 * PAGE_SIZE, 2 * PAGE_SIZE, VMA_READ);
+    ok &= test_vma_layout(&set, "Protected middle", 3, (const kuint32_t[]){ 0, 2, 2, 4, 4, 6 });
+    ok &= set.vmas[1].prot == TEST_VMA_RO;
+    ok &= vmm_vma_protect(&set, TEST_VMA_BASE + 2 * PAGE_SIZE, 2 * PAGE_SIZE, VMA_READ | VMA_WRITE);
+    ok &= test_vma_layout(&set, "Restored middle", 1, (const kuint32_t[]){ 0, 6 });
+    ok &= !vmm_vma_protect(&set, TEST_VMA_BASE + 5 * PAGE_SIZE, 2 * PAGE_SIZE, VMA_READ);
+
+    // Removing the middle leaves a hole, which is found by a first fit search and by a hint that fits it
+    ok &= vmm_vma_remove(&set, TEST_VMA_BASE + 2 * PAGE_SIZE, 2 * PAGE_SIZE);
+    ok &= test_vma_layout(&set, "Removed middle", 2, (const kuint32_t[]){ 0, 2, 4, 6 });
+    virtual_addr_t high = TEST_VMA_BASE + 16 * PAGE_SIZE;
+    ok &= vmm_vma_find_free(&set, 0, 2 * PAGE_SIZE, TEST_VMA_BASE, high) == TEST_VMA_BASE + 2 * PAGE_SIZE;
+    ok &= vmm_vma_find_free(&set, TEST_VMA_BASE + 8 * PAGE_SIZE, PAGE_SIZE, TEST_VMA_BASE, high) ==
+          TEST_VMA_BASE + 8 * PAGE_SIZE;
+    ok &= vmm_vma_find_free(&set, TEST_VMA_BASE, 3 * PAGE_SIZE, TEST_VMA_BASE, high) == TEST_VMA_BASE + 6 * PAGE_SIZE;
+    ok &= vmm_vma_find_free(&set, 0, 16 * PAGE_SIZE, TEST_VMA_BASE, high) == 0;
+
+    ok &= test_vmm_mprotect();
+    debug_vmm_faults();
+
+    if (ok) {
+        LOG_INFO("Virtual memory area testing completed!\n");
+    } else {
+        LOG_ERR("Virtual memory area testing failed!\n");
+    }
+    return ok;
 }
 
 void test_heap_allocations() {
@@ -242,7 +641,7 @@ void test_heap_allocations() {
 
             expand_test = expanded;
         } else if (expanded == expand_test) {
-            LOG_INFO("Block was shrunk in place (no reallocation needed)\n");
+            LOG_INFO("Block was grown in place into its free neighbour (no copy needed)\n");
         } else {
             LOG_ERR("Expansion failed!\n");
         }
@@ -283,10 +682,456 @@ void test_heap_allocations() {
     if (null_realloc) kfree(null_realloc);
     if (expand_test) kfree(expand_test);
 
+    // Aligned and zeroed allocations
+    for (size_t align = 16; align <= PAGE_SIZE; align <<= 4) {
+        generic_ptr aligned = kmalloc_aligned(100, align);
+        if (!aligned || ((virtual_addr_t)aligned & (align - 1))) {
+            LOG_ERR("kmalloc_aligned(100, %d) returned 0x%x!\n", align, aligned);
+        }
+        kfree(aligned);
+    }
+    kuint8_t* zeroed = kcalloc(64, 64);
+    if (zeroed) {
+        for (int i = 0; i < 64 * 64; i++) {
+            if (zeroed[i] != 0) {
+                LOG_ERR("kcalloc returned dirty memory at offset %d!\n", i);
+                break;
+            }
+        }
+        kfree(zeroed);
+    }
+
+    // A large buffer that was written goes back to the PMM once freed
+    kuint32_t trimmed_before = heap_get_trimmed_pages();
+    kuint8_t* large = kmalloc(HEAP_TRIM_THRESHOLD * 2);
+    if (large) {
+        memset(large, 0xAA, HEAP_TRIM_THRESHOLD * 2);
+        kfree(large);
+        kuint32_t trimmed = heap_get_trimmed_pages() - trimmed_before;
+        if (trimmed == 0) {
+            LOG_ERR("Freeing a %d byte buffer trimmed no pages!\n", HEAP_TRIM_THRESHOLD * 2);
+        } else {
+            LOG_INFO("Freeing a %d byte buffer trimmed %d pages\n", HEAP_TRIM_THRESHOLD * 2, trimmed);
+        }
+    } else {
+        LOG_ERR("Failed to allocate a %d byte buffer to trim\n", HEAP_TRIM_THRESHOLD * 2);
+    }
+
+    // No free block can hold the whole heap, so this one is only satisfied by growing the heap
+    size_t grow_size = heap_get_total_size();
+    generic_ptr grown = kmalloc(grow_size);
+    if (grown) {
+        kfree(grown);
+    } else {
+        LOG_ERR("kmalloc(%d) failed to grow the heap!\n", grow_size);
+    }
+
     // Print heap statistics after all freeing
     LOG_INFO("After all freeing - Total: %d bytes, Used: %d bytes, Free: %d bytes\n",
                           heap_get_total_size(), heap_get_used_size(), heap_get_free_size());
 
     LOG_INFO("Heap testing completed!\n");
 }
+
+#define TEST_FORK_DATA_START 0x2000000
+
+// Forks a user process and writes its first data page through both address spaces, the second page is only read.
+// The parent's write has to copy the shared frame, the child is then the last holder and gets the original back
+// writable. The writes come from ring 0, so they only fault because CR0.WP is set.
+bool test_fork_cow() {
+    static unsigned char program[] = { 0xEB, 0xFE };   // jmp $
+    LOG_INFO("Testing copy-on-write fork...\n");
+
+    kuint32_t flags = interrupts_save();
+    process_t* parent = proc_create_user(program, sizeof(program), false);
+    if (!parent) {
+        LOG_ERR("Failed to create the fork test parent\n");
+        interrupts_restore(flags);
+        return false;
+    }
+    parent->current_state = STOPPED;
+    vmm_vma_insert(&parent->vmas, TEST_FORK_DATA_START, 2 * PAGE_SIZE, VMA_READ | VMA_WRITE | VMA_USER, VMA_ANONYMOUS);
+    volatile kuint32_t* data = (volatile kuint32_t*)TEST_FORK_DATA_START;
+    volatile kuint32_t* shared = (volatile kuint32_t*)(TEST_FORK_DATA_START + PAGE_SIZE);
+
+    // The parent faults its pages in by writing them
+    process_t* self = proc_enter(parent);
+    *data = 0x11111111;
+    *shared = 0x22222222;
+    proc_enter(self);
+
+    registers_t regs;
+    memset(&regs, 0, sizeof(regs));
+    regs.ds = regs.es = regs.fs = regs.gs = regs.ss = 0x23;
+    regs.cs = 0x1B;
+    regs.eip = USER_CODE_VIRTUAL_START;
+    regs.eflags = 0x202;
+
+    // A first fork leaves a kernel stack in the stack cache, so the counted one doesn't come from vmalloc
+    process_t* warmup = proc_clone(parent, &regs);
+    if (warmup) {
+        warmup->current_state = STOPPED;
+        proc_destroy(warmup);
+    }
+    kuint32_t free_before = pmm_get_free_blocks();
+    vmm_fault_stats_t stats_before;
+    vmm_get_fault_stats(&stats_before);
+
+    process_t* child = proc_clone(parent, &regs);
+    if (!child) {
+        LOG_ERR("Failed to fork the test parent\n");
+        proc_destroy(parent);
+        interrupts_restore(flags);
+        return false;
+    }
+    child->current_state = STOPPED;
+    kuint32_t original = 0;
+    vmm_get_frame_dir((pde_t*)parent->page_directory, TEST_FORK_DATA_START, &original);
+
+    proc_enter(parent);
+    *data = 0x33333333;
+    proc_enter(child);
+    kuint32_t child_before = *data;
+    *data = 0x44444444;
+    kuint32_t child_after = *data;
+    kuint32_t child_shared = *shared;
+    proc_enter(parent);
+    kuint32_t parent_after = *data;
+    proc_enter(self);
+
+    bool ok = true;
+    if (child_before != 0x11111111 || child_after != 0x44444444 || parent_after != 0x33333333 ||
+        child_shared != 0x22222222) {
+        LOG_ERR("Forked data is wrong: child 0x%x then 0x%x, parent 0x%x, shared 0x%x\n", child_before,
+                child_after, parent_after, child_shared);
+        ok = false;
+    }
+
+    // The written page diverged, the child kept the original frame and the read page is still shared
+    kuint32_t parent_frame = 0, child_frame = 0, parent_shared_frame = 0, child_shared_frame = 0;
+    vmm_get_frame_dir((pde_t*)parent->page_directory, TEST_FORK_DATA_START, &parent_frame);
+    vmm_get_frame_dir((pde_t*)child->page_directory, TEST_FORK_DATA_START, &child_frame);
+    vmm_get_frame_dir((pde_t*)parent->page_directory, TEST_FORK_DATA_START + PAGE_SIZE, &parent_shared_frame);
+    vmm_get_frame_dir((pde_t*)child->page_directory, TEST_FORK_DATA_START + PAGE_SIZE, &child_shared_frame);
+    if (parent_frame == child_frame || child_frame != original || parent_shared_frame != child_shared_frame) {
+        LOG_ERR("Frames after the writes: parent 0x%x, child 0x%x (was 0x%x), shared 0x%x and 0x%x\n",
+                parent_frame, child_frame, original, parent_shared_frame, child_shared_frame);
+        ok = false;
+    }
+
+    vmm_fault_stats_t stats;
+    vmm_get_fault_stats(&stats);
+    if (stats.cow_copies != stats_before.cow_copies + 1 || stats.cow_reuses != stats_before.cow_reuses + 1) {
+        LOG_ERR("Expected one copy and one reuse, got %d and %d\n", stats.cow_copies - stats_before.cow_copies,
+                stats.cow_reuses - stats_before.cow_reuses);
+        ok = false;
+    }
+
+    proc_destroy(child);
+    if (pmm_get_free_blocks() != free_before) {
+        LOG_ERR("Fork test leaked %d blocks!\n", free_before - pmm_get_free_blocks());
+        ok = false;
+    }
+    proc_destroy(parent);
+    interrupts_restore(flags);
+
+    if (ok) {
+        LOG_INFO("Copy-on-write fork testing completed!\n");
+    } else {
+        LOG_ERR("Copy-on-write fork testing failed!\n");
+    }
+    return ok;
+}
+#ifdef BENCHMARK
+#define BENCH_PMM_BATCH 256
+#define BENCH_PMM_ROUNDS 32
+
+// Small LCG so the benchmarks get the same scattered layout on every boot
+static kuint32_t bench_rand_state = 12345;
+static kuint32_t bench_rand() {
+    bench_rand_state = bench_rand_state * 1103515245 + 12345;
+    return bench_rand_state >> 16;
+}
+
+static kuint32_t bench_per_second(kuint32_t ops, kuint64_t cycles) {
+    if (cycles == 0) return 0;
+    return (kuint32_t)(((kuint64_t)ops * tsc_get_khz() * 1000) / cycles);
+}
+
+// Fills the bitmap completely, then frees a pseudo-random selection of blocks so that the requested share
+// of memory stays in use with the free blocks scattered through it. Then times batches of allocations.
+static void bench_pmm_alloc_at(kuint32_t occupancy_pct, kuint32_t* held, kuint32_t held_entries) {
+    static generic_ptr batch[BENCH_PMM_BATCH];
+    memset(held, 0, held_entries * sizeof(kuint32_t));
+
+    // The free count includes frames pmm_alloc_block() never hands out, so stop at the first failure instead.
+    // A failure reads as frame 0, which must never be recorded or freed.
+    for (;;) {
+        generic_ptr block = pmm_alloc_block();
+        if (block == NULL) {
+            break;
+        }
+        kuint32_t frame = (physical_addr_t)block / PMM_BLOCK_SIZE;
+        held[frame / 32] |= 1 << (frame % 32);
+    }
+    for (kuint32_t frame = 0; frame < held_entries * 32; frame++) {
+        if ((held[frame / 32] & (1 << (frame % 32))) && (bench_rand() % 100) >= occupancy_pct) {
+            pmm_free_block((generic_ptr)(frame * PMM_BLOCK_SIZE));
+            held[frame / 32] &= ~(1 << (frame % 32));
+        }
+    }
+
+    kuint64_t cycles = 0;
+    kuint32_t allocations = 0;
+    for (int round = 0; round < BENCH_PMM_ROUNDS; round++) {
+        kuint64_t start = tsc_read();
+        for (int i = 0; i < BENCH_PMM_BATCH; i++) {
+            batch[i] = pmm_alloc_block();
+        }
+        cycles += tsc_read() - start;
+        allocations += BENCH_PMM_BATCH;
+
+        for (int i = 0; i < BENCH_PMM_BATCH; i++) {
+            if (batch[i]) pmm_free_block(batch[i]);
+        }
+    }
+
+    LOG_INFO("PMM at %d%% occupancy: %d allocs/sec (%d cycles/alloc)\n",
+             occupancy_pct, bench_per_second(allocations, cycles), (kuint32_t)(cycles / allocations));
+
+    // Give back everything we held to reach the occupancy level
+    for (kuint32_t frame = 0; frame < held_entries * 32; frame++) {
+        if (held[frame / 32] & (1 << (frame % 32))) {
+            pmm_free_block((generic_ptr)(frame * PMM_BLOCK_SIZE));
+        }
+    }
+}
+
+void bench_pmm_alloc(pmm_init_status_t *pmm_status) {
+    LOG_INFO("Benchmarking PMM block allocation (TSC at %d KHz)...\n", tsc_get_khz());
+
+    // One bit per block to remember which blocks the benchmark is holding
+    kuint32_t held_entries = (pmm_status->max_blocks + 31) / 32;
+    kuint32_t* held = vmalloc(held_entries * sizeof(kuint32_t));
+    if (!held) {
+        LOG_ERR("Failed to allocate benchmark bookkeeping\n");
+        return;
+    }
+
+    kuint32_t free_before = pmm_get_free_blocks();
+    bench_pmm_alloc_at(10, held, held_entries);
+    bench_pmm_alloc_at(50, held, held_entries);
+    bench_pmm_alloc_at(90, held, held_entries);
+    vfree(held);
+
+    if (pmm_get_free_blocks() != free_before) {
+        LOG_ERR("PMM benchmark leaked %d blocks!\n", free_before - pmm_get_free_blocks());
+    }
+    debug_pmm_magazines();
+    LOG_INFO("PMM benchmark completed!\n");
+}
+
+#define BENCH_MAP_PAGES 256
+#define BENCH_MAP_ROUNDS 32
+#define BENCH_MAP_VIRTUAL_START KERNEL_VIRTUAL_BASE     // Unused until the kernel moves to the higher half
+
+// Maps and unmaps a 1MB buffer, first one page at a time and then as a range
+void bench_vmm_map() {
+    LOG_INFO("Benchmarking VMM mapping...\n");
+    kuint32_t order = 8;
+    physical_addr_t buffer = (physical_addr_t)pmm_alloc_blocks(order);
+    if (!buffer) {
+        LOG_ERR("Failed to allocate the mapping benchmark buffer\n");
+        return;
+    }
+    pde_t* dir = vmm_get_kernel_directory();
+    kuint32_t flags = PTE_PRESENT | PTE_READ_WRITE | PTE_NO_EXECUTE;
+
+    kuint64_t single_cycles = 0, range_cycles = 0;
+    for (int round = 0; round < BENCH_MAP_ROUNDS; round++) {
+        kuint64_t start = tsc_read();
+        for (kuint32_t page = 0; page < BENCH_MAP_PAGES; page++) {
+            vmm_map_page(BENCH_MAP_VIRTUAL_START + page * PAGE_SIZE, buffer + page * PAGE_SIZE, flags);
+        }
+        single_cycles += tsc_read() - start;
+        for (kuint32_t page = 0; page < BENCH_MAP_PAGES; page++) {
+            vmm_unmap_page(BENCH_MAP_VIRTUAL_START + page * PAGE_SIZE);
+        }
+
+        start = tsc_read();
+        vmm_map_range(dir, BENCH_MAP_VIRTUAL_START, buffer / PAGE_SIZE, BENCH_MAP_PAGES, flags);
+        range_cycles += tsc_read() - start;
+        vmm_unmap_range(dir, BENCH_MAP_VIRTUAL_START, BENCH_MAP_PAGES);
+    }
+    pmm_free_blocks((generic_ptr)buffer, order);
+
+    kuint32_t pages = BENCH_MAP_PAGES * BENCH_MAP_ROUNDS;
+    LOG_INFO("vmm_map_page: %d pages/sec, vmm_map_range: %d pages/sec\n",
+             bench_per_second(pages, single_cycles), bench_per_second(pages, range_cycles));
+}
+
+#define BENCH_KMALLOC_MAX_LIVE 2048
+#define BENCH_KMALLOC_OPS 4096
+#define BENCH_KMALLOC_SEED 12345
+
+// Mostly small objects, some buffers and the odd page sized allocation
+static size_t bench_kmalloc_size() {
+    kuint32_t pick = bench_rand() % 100;
+    if (pick < 70) return 16 + bench_rand() % 112;
+    if (pick < 95) return 128 + bench_rand() % 896;
+    return 1024 + bench_rand() % 3072;
+}
+
+// Replays a random trace that keeps 'live' allocations around, each step frees a random one and allocates a new
+// size in its place. The trace restarts from its own seed, so it doesn't depend on which benchmarks ran before.
+// Segregated lists should take about as long per operation however many blocks are live.
+static void bench_kmalloc_at(kuint32_t live) {
+    static generic_ptr slots[BENCH_KMALLOC_MAX_LIVE];
+    bench_rand_state = BENCH_KMALLOC_SEED;
+    for (kuint32_t i = 0; i < live; i++) {
+        slots[i] = kmalloc(bench_kmalloc_size());
+    }
+
+    kuint64_t alloc_cycles = 0, free_cycles = 0;
+    for (kuint32_t op = 0; op < BENCH_KMALLOC_OPS; op++) {
+        kuint32_t slot = bench_rand() % live;
+        size_t size = bench_kmalloc_size();
+        kuint64_t start = tsc_read();
+        kfree(slots[slot]);
+        kuint64_t freed = tsc_read();
+        slots[slot] = kmalloc(size);
+        alloc_cycles += tsc_read() - freed;
+        free_cycles += freed - start;
+    }
+
+    for (kuint32_t i = 0; i < live; i++) {
+        kfree(slots[i]);
+    }
+    LOG_INFO("kmalloc with %d live blocks: %d cycles/alloc, %d cycles/free\n", live,
+             (kuint32_t)(alloc_cycles / BENCH_KMALLOC_OPS), (kuint32_t)(free_cycles / BENCH_KMALLOC_OPS));
+}
+
+void bench_kmalloc() {
+    LOG_INFO("Benchmarking kmalloc...\n");
+    size_t used_before = heap_get_used_size();
+    bench_kmalloc_at(64);
+    bench_kmalloc_at(512);
+    bench_kmalloc_at(BENCH_KMALLOC_MAX_LIVE);
+    if (heap_get_used_size() != used_before) {
+        LOG_ERR("kmalloc benchmark leaked %d bytes!\n", heap_get_used_size() - used_before);
+    }
+    LOG_INFO("Heap is %d bytes after the benchmark\n", heap_get_total_size());
+}
+
+#define BENCH_FORK_PAGES 64
+#define BENCH_FORK_ROUNDS 32
+#define BENCH_FORK_DATA_START 0x2000000
+
+// Forks a user process with BENCH_FORK_PAGES of writable data and tears the child down again. The parent never
+// runs, it only provides the image and an interrupt frame to fork from.
+void bench_fork() {
+    static unsigned char program[] = { 0xEB, 0xFE };   // jmp $
+    LOG_INFO("Benchmarking fork + exit...\n");
+
+    kuint32_t flags = interrupts_save();
+    process_t* parent = proc_create_user(program, sizeof(program), false);
+    if (!parent) {
+        LOG_ERR("Failed to create the fork benchmark parent\n");
+        interrupts_restore(flags);
+        return;
+    }
+    parent->current_state = STOPPED;
+    vmm_vma_insert(&parent->vmas, BENCH_FORK_DATA_START, BENCH_FORK_PAGES * PAGE_SIZE,
+                   VMA_READ | VMA_WRITE | VMA_USER, VMA_ANONYMOUS);
+    for (kuint32_t page = 0; page < BENCH_FORK_PAGES; page++) {
+        kuint32_t frame = pmm_alloc_zeroed_frame(PMM_ZONE_HIGH64);
+        if (frame == PMM_NO_FRAME) {
+            break;
+        }
+        vmm_map_frame(parent->page_directory, BENCH_FORK_DATA_START + page * PAGE_SIZE, frame,
+                      PTE_PRESENT | PTE_USER | PTE_READ_WRITE);
+    }
+
+    registers_t regs;
+    memset(&regs, 0, sizeof(regs));
+    regs.ds = regs.es = regs.fs = regs.gs = regs.ss = 0x23;
+    regs.cs = 0x1B;
+    regs.eip = USER_CODE_VIRTUAL_START;
+    regs.eflags = 0x202;
+
+    // One untimed round first, so the child's kernel stack sits in the stack cache before counting free blocks
+    process_t* warmup = proc_clone(parent, &regs);
+    if (warmup) {
+        warmup->current_state = STOPPED;
+        proc_destroy(warmup);
+    }
+    kuint32_t free_before = pmm_get_free_blocks();
+
+    kuint64_t fork_cycles = 0, exit_cycles = 0;
+    kuint32_t rounds = 0;
+    for (; rounds < BENCH_FORK_ROUNDS; rounds++) {
+        kuint64_t start = tsc_read();
+        process_t* child = proc_clone(parent, &regs);
+        kuint64_t forked = tsc_read();
+        if (!child) {
+            break;
+        }
+        child->current_state = STOPPED;
+        proc_destroy(child);
+        fork_cycles += forked - start;
+        exit_cycles += tsc_read() - forked;
+    }
+
+    if (rounds > 0) {
+        LOG_INFO("fork of %d pages: %d cycles, exit: %d cycles\n", BENCH_FORK_PAGES,
+                 (kuint32_t)(fork_cycles / rounds), (kuint32_t)(exit_cycles / rounds));
+    }
+    if (pmm_get_free_blocks() != free_before) {
+        LOG_ERR("Fork benchmark leaked %d blocks!\n", free_before - pmm_get_free_blocks());
+    }
+    proc_destroy(parent);
+    interrupts_restore(flags);
+}
+
+#define BENCH_SWITCH_ROUNDS 64
+
+// Reloads CR3 the way the scheduler does on a switch, then times touching every heap page. Global kernel
+// translations survive the reload, otherwise every page touched is a TLB miss and a page walk.
+static kuint32_t bench_switch_cycles(kuint32_t pages) {
+    volatile kuint32_t* heap = (volatile kuint32_t*)HEAP_VIRTUAL_START;
+    kuint64_t cycles = 0;
+    for (int round = 0; round < BENCH_SWITCH_ROUNDS; round++) {
+        for (kuint32_t page = 0; page < pages; page++) {
+            (void)heap[page * PAGE_SIZE / sizeof(kuint32_t)];
+        }
+
+        kuint64_t start = tsc_read();
+        load_page_directory(vmm_get_kernel_directory());
+        for (kuint32_t page = 0; page < pages; page++) {
+            (void)heap[page * PAGE_SIZE / sizeof(kuint32_t)];
+        }
+        cycles += tsc_read() - start;
+    }
+    return (kuint32_t)(cycles / BENCH_SWITCH_ROUNDS);
+}
+
+void bench_context_switch() {
+    if (!vmm_global_pages_enabled()) {
+        LOG_INFO("CPU has no global pages, skipping the context switch benchmark\n");
+        return;
+    }
+
+    LOG_INFO("Benchmarking address space switches...\n");
+    kuint32_t pages = heap_get_total_size() / PAGE_SIZE;
+    kuint32_t global_cycles = bench_switch_cycles(pages);
+    vmm_set_global_pages(false);
+    kuint32_t flushed_cycles = bench_switch_cycles(pages);
+    vmm_set_global_pages(true);
+
+    LOG_INFO("Switch + %d kernel pages: %d cycles with global pages, %d cycles without\n",
+             pages, global_cycles, flushed_cycles);
+    LOG_INFO("Global pages save up to %d TLB misses per switch (%d cycles/miss)\n",
+             pages, flushed_cycles > global_cycles ? (flushed_cycles - global_cycles) / pages : 0);
+}
+#endif
 #endif
\ No newline at end of file
@@ -1,13 +1,255 @@
 #include <kernel/heap.h>
 #include <kernel/log.h>
+#include <kernel/sync.h>
 #include <arch/i386/pmm.h>
 #include <arch/i386/vmm.h>
 #include <libc/strings.h>
 #include <libc/stdint.h>
 
 static heap_block_t* heap_start = NULL;
+static heap_block_t* heap_last = NULL;      // Last block in memory, the one heap_expand() grows
 static virtual_addr_t heap_virtual_start = 0;
 static size_t heap_size = 0;
+static size_t heap_initial_size = 0;       // Trimming never shrinks the heap below its initial size
+static size_t heap_used = 0;
+static kuint32_t heap_trimmed_pages = 0;
+
+// Segregated free lists and the bitmaps of the non-empty ones. Bit fl of fl_bitmap is set when any list of
+// first level fl is non-empty, bit sl of sl_bitmap[fl] when free_lists[fl][sl] is.
+static heap_block_t* free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+static kuint32_t fl_bitmap = 0;
+static kuint32_t sl_bitmap[HEAP_FL_COUNT];
+
+// The heap is an anonymous area, frames are only allocated when the page fault handler sees a page touched.
+// The fixed kernel windows above it aren't kernel VMAs, so growing into them has to be refused here.
+static bool heap_reserve_pages(virtual_addr_t start, size_t size) {
+    if (start >= HEAP_VIRTUAL_END || size > HEAP_VIRTUAL_END - start) {
+        LOG_ERR("HEAP Error: 0x%x bytes at 0x%x would run into the page array", size, start);
+        return false;
+    }
+    return vmm_vma_insert(vmm_get_kernel_vmas(), start, size, VMA_READ | VMA_WRITE, VMA_ANONYMOUS);
+}
+
+// Size class a block of this size belongs to
+static void heap_mapping_insert(size_t size, kuint32_t* fl, kuint32_t* sl) {
+    if (size < HEAP_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (HEAP_SMALL_BLOCK / HEAP_SL_COUNT);
+    } else {
+        kuint32_t msb = 31 - __builtin_clz(size);
+        *sl = (size >> (msb - HEAP_SL_COUNT_LOG2)) ^ HEAP_SL_COUNT;
+        *fl = msb - HEAP_FL_SHIFT + 1;
+    }
+}
+
+// Size class to start searching from, rounded up so every block in it is large enough
+static void heap_mapping_search(size_t size, kuint32_t* fl, kuint32_t* sl) {
+    if (size >= HEAP_SMALL_BLOCK) {
+        kuint32_t msb = 31 - __builtin_clz(size);
+        size += (1u << (msb - HEAP_SL_COUNT_LOG2)) - 1;
+    }
+    heap_mapping_insert(size, fl, sl);
+}
+
+static size_t heap_block_size_of(const heap_block_t* block) {
+    return block->size & ~HEAP_BLOCK_FLAGS;
+}
+
+// Changes a block's size, keeping its flags
+static void heap_set_size(heap_block_t* block, size_t size) {
+    block->size = size | (block->size & HEAP_BLOCK_FLAGS);
+}
+
+static heap_block_t* heap_next_block(heap_block_t* block) {
+    virtual_addr_t next = (virtual_addr_t)block + heap_block_size_of(block);
+    return next < heap_virtual_start + heap_size ? (heap_block_t*)next : NULL;
+}
+
+// The block before this one, found through its boundary tag. Only free blocks have one.
+static heap_block_t* heap_prev_free_block(heap_block_t* block) {
+    if (!(block->size & HEAP_BLOCK_PREV_FREE)) {
+        return NULL;
+    }
+    size_t prev_size = *(size_t*)((virtual_addr_t)block - sizeof(size_t));
+    return (heap_block_t*)((virtual_addr_t)block - prev_size);
+}
+
+static void heap_insert_free(heap_block_t* block) {
+    size_t size = heap_block_size_of(block);
+    kuint32_t fl, sl;
+    heap_mapping_insert(size, &fl, &sl);
+
+    // Mark it free, write its boundary tag and tell the next block about it
+    block->size |= HEAP_BLOCK_FREE;
+    *(size_t*)((virtual_addr_t)block + size - sizeof(size_t)) = size;
+    heap_block_t* next = heap_next_block(block);
+    if (next) {
+        next->size |= HEAP_BLOCK_PREV_FREE;
+    }
+
+    block->prev_free = NULL;
+    block->next_free = free_lists[fl][sl];
+    if (block->next_free) {
+        block->next_free->prev_free = block;
+    }
+    free_lists[fl][sl] = block;
+    fl_bitmap |= 1u << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+static void heap_remove_free(heap_block_t* block) {
+    kuint32_t fl, sl;
+    heap_mapping_insert(heap_block_size_of(block), &fl, &sl);
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists[fl][sl] = block->next_free;
+        if (!free_lists[fl][sl]) {
+            sl_bitmap[fl] &= ~(1u << sl);
+            if (!sl_bitmap[fl]) {
+                fl_bitmap &= ~(1u << fl);
+            }
+        }
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    block->size &= ~HEAP_BLOCK_FREE;
+    heap_block_t* next = heap_next_block(block);
+    if (next) {
+        next->size &= ~HEAP_BLOCK_PREV_FREE;
+    }
+}
+
+// Returns the head of the first non-empty list at or above a size class, two bit scans at most
+static heap_block_t* heap_find_free(kuint32_t fl, kuint32_t sl) {
+    kuint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        kuint32_t fl_map = fl + 1 < HEAP_FL_COUNT ? fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    return free_lists[fl][__builtin_ctz(sl_map)];
+}
+
+// Merges a block that is off the free lists with its free neighbours and returns the merged block. Neither
+// neighbour needs a walk, the next block starts where this one ends and the previous one left a boundary tag.
+static heap_block_t* heap_coalesce(heap_block_t* block) {
+    heap_block_t* next = heap_next_block(block);
+    if (next && (next->size & HEAP_BLOCK_FREE)) {
+        heap_remove_free(next);
+        heap_set_size(block, heap_block_size_of(block) + heap_block_size_of(next));
+        if (next == heap_last) {
+            heap_last = block;
+        }
+    }
+
+    heap_block_t* prev = heap_prev_free_block(block);
+    if (prev) {
+        heap_remove_free(prev);
+        heap_set_size(prev, heap_block_size_of(prev) + heap_block_size_of(block));
+        if (block == heap_last) {
+            heap_last = prev;
+        }
+        block = prev;
+    }
+    return block;
+}
+
+// Cuts a used block down to 'size' and frees the tail, if the tail is big enough to be a block of its own
+static void heap_split(heap_block_t* block, size_t size) {
+    size_t block_size = heap_block_size_of(block);
+    if (block_size < size + HEAP_MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    heap_block_t* rest = (heap_block_t*)((virtual_addr_t)block + size);
+    rest->size = block_size - size;
+    rest->magic = HEAP_MAGIC;
+    heap_set_size(block, size);
+    if (block == heap_last) {
+        heap_last = rest;
+    }
+
+    // A block shrunk by krealloc may have a free block behind it
+    heap_insert_free(heap_coalesce(rest));
+}
+
+// Where the pages that may still be mapped start once a block merges with the free block before it. A free block at
+// or above HEAP_TRIM_THRESHOLD was trimmed when it got that large, only the page with its boundary tag can be left.
+// A smaller one was never trimmed, any of its pages can be.
+static virtual_addr_t heap_trim_start(heap_block_t* block) {
+    heap_block_t* prev = heap_prev_free_block(block);
+    if (prev == NULL) {
+        return (virtual_addr_t)block;
+    }
+    if (heap_block_size_of(prev) >= HEAP_TRIM_THRESHOLD) {
+        return (virtual_addr_t)block - sizeof(size_t);
+    }
+    return (virtual_addr_t)prev;
+}
+
+// The same for the free block after this one, of a large one only the page with its header can be left
+static virtual_addr_t heap_trim_end(heap_block_t* block) {
+    virtual_addr_t end = (virtual_addr_t)block + heap_block_size_of(block);
+    heap_block_t* next = heap_next_block(block);
+    if (next == NULL || !(next->size & HEAP_BLOCK_FREE)) {
+        return end;
+    }
+    if (heap_block_size_of(next) >= HEAP_TRIM_THRESHOLD) {
+        return end + sizeof(heap_block_t);
+    }
+    return end + heap_block_size_of(next);
+}
+
+// Hands the pages of a large free block that lie in [trim_start, trim_end) back to the PMM. Callers pass the part of
+// the block that may still have pages mapped, see heap_trim_start() and heap_trim_end(), so the work stays
+// proportional to what was just freed rather than to the whole block. The first and last page of the block stay,
+// they hold the header, the free list links and the boundary tag. A free block at the end of the heap is cut down
+// and the heap shrinks. Called with interrupts off and the block on its free list.
+static void heap_trim(heap_block_t* block, virtual_addr_t trim_start, virtual_addr_t trim_end) {
+    pde_t* dir = vmm_get_kernel_directory();
+    kuint32_t free_before = pmm_get_free_blocks();
+    virtual_addr_t heap_end = heap_virtual_start + heap_size;
+    virtual_addr_t block_start = (virtual_addr_t)block;
+
+    if (block == heap_last) {
+        virtual_addr_t new_end = (block_start + HEAP_MIN_BLOCK_SIZE + PAGE_SIZE - 1) & PTE_FRAME;
+        if (new_end < heap_virtual_start + heap_initial_size) {
+            new_end = heap_virtual_start + heap_initial_size;
+        }
+        if (new_end + HEAP_TRIM_THRESHOLD <= heap_end && vmm_vma_remove(vmm_get_kernel_vmas(), new_end, heap_end - new_end)) {
+            heap_remove_free(block);
+            heap_set_size(block, new_end - block_start);
+            heap_size = new_end - heap_virtual_start;
+            vmm_free_range(dir, new_end, (heap_end - new_end) / PAGE_SIZE);
+            heap_insert_free(block);
+        }
+    }
+
+    virtual_addr_t first = (block_start + sizeof(heap_block_t) + PAGE_SIZE - 1) & PTE_FRAME;
+    virtual_addr_t last = (block_start + heap_block_size_of(block) - sizeof(size_t)) & PTE_FRAME;
+    if (first < (trim_start & PTE_FRAME)) {
+        first = trim_start & PTE_FRAME;
+    }
+    if (last > ((trim_end + PAGE_SIZE - 1) & PTE_FRAME)) {
+        last = (trim_end + PAGE_SIZE - 1) & PTE_FRAME;
+    }
+    if (first < last) {
+        vmm_free_range(dir, first, (last - first) / PAGE_SIZE);
+    }
+    heap_trimmed_pages += pmm_get_free_blocks() - free_before;
+}
+
+// Size of the block needed for a payload of 'size' bytes
+static size_t heap_block_size(size_t size) {
+    size_t block_size = (size + HEAP_HEADER_SIZE + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    return block_size < HEAP_MIN_BLOCK_SIZE ? HEAP_MIN_BLOCK_SIZE : block_size;
+}
 
 void heap_init(virtual_addr_t start, size_t size) {
     // Align the start address to a page boundary (use bitwise AND with 0xFFFFF000)
@@ -17,140 +259,169 @@ void heap_init(virtual_addr_t start, size_t size) {
     if(size < HEAP_MIN_SIZE) {
         size = HEAP_MIN_SIZE;
     }
-    
+
     // Align heap size to page boundary
     size_t aligned_size = (size + 0xFFF) & 0xFFFFF000;
 
-    // Map pages for the heap using vmm_map_page()
-    //   - Loop through each 4KB page
-    //   - Allocate physical memory with pmm_alloc_block()
-    //   - Map virtual to physical addresses with proper flags (PTE_PRESENT | PTE_READ_WRITE)
-    for(kuint32_t offset = 0; offset < aligned_size; offset += PAGE_SIZE) {
-        virtual_addr_t addr = aligned_addr + offset;
-        physical_addr_t block = (physical_addr_t)pmm_alloc_block();
-        if(!block) {
-            LOG_ERR("HEAP Error: Failed to allocate physical memory for heap");
-            return;
-        }
-        vmm_map_page(addr, block, (PTE_PRESENT | PTE_READ_WRITE));
+    // Reserve the pages for the heap
+    if(!heap_reserve_pages(aligned_addr, aligned_size)) {
+        LOG_ERR("HEAP Error: Failed to reserve virtual memory for heap");
+        return;
     }
-    
+
     // Initialize the first block that represents the entire heap
     heap_start = (heap_block_t*)aligned_addr;
     heap_start->size = aligned_size;
-    heap_start->next = NULL;
-    heap_start->prev = NULL;
-    heap_start->free = 1;
     heap_start->magic = HEAP_MAGIC;
+    heap_last = heap_start;
 
     // Store heap_start, heap_virtual_start, and heap_size in global variables
-    heap_virtual_start = heap_start;
+    heap_virtual_start = aligned_addr;
     heap_size = aligned_size;
+    heap_initial_size = aligned_size;
+    heap_used = 0;
+    heap_insert_free(heap_start);
     LOG_INFO("Heap initialized at 0x%x with size 0x%x", heap_virtual_start, heap_size);
 }
 
+// Takes a free block of at least 'search_size' bytes off the free lists, expanding the heap if none is left.
+// Called with interrupts off.
+static heap_block_t* heap_take_block(size_t search_size) {
+    kuint32_t fl, sl;
+    heap_mapping_search(search_size, &fl, &sl);
+    heap_block_t* block = heap_find_free(fl, sl);
+
+    // Time to expand the heap...
+    if (block == NULL) {
+        size_t expansion_needed = search_size > heap_size / 4 ? search_size : heap_size / 4;
+        if (!heap_expand(expansion_needed)) {
+            LOG_ERR("HEAP Error: No suitable block found and expansion failed for size: %d", search_size);
+            return NULL;
+        }
+        // The expansion merged into the last block, which is large enough but may sit in a class below the
+        // rounded up one the search starts from
+        block = heap_find_free(fl, sl);
+        if (block == NULL && (heap_last->size & HEAP_BLOCK_FREE) && heap_block_size_of(heap_last) >= search_size) {
+            block = heap_last;
+        }
+        if (block == NULL) {
+            LOG_ERR("HEAP Error: No suitable block found for size: %d", search_size);
+            return NULL;
+        }
+    }
+
+    if (block->magic != HEAP_MAGIC) {
+        LOG_ERR("HEAP Error: Block corruption detected!");
+        return NULL;
+    }
+    heap_remove_free(block);
+    return block;
+}
+
 generic_ptr kmalloc(size_t size) {
     // Check if heap is initialized (heap_start != NULL)
     if(heap_start == NULL) {
         LOG_ERR("HEAP Error: Heap not initialized, you must initialize the heap before allocating");
         return NULL;
     }
-    
-    // Calculate total size needed (requested size + header size)
-    size_t total_size = size + sizeof(heap_block_t);
-    
-    // Align up total size to 4-byte boundary
-    size_t aligned_size = (total_size + 3) & ~3;
-    
-    // Find a free block using first-fit algorithm:
-    //   - Start at heap_start
-    //   - Traverse the linked list of blocks heap_block_t
-    //   - Look for a free block (free == 1) that's large enough
-    heap_block_t* cur_block = heap_start;
-    while (cur_block != NULL) {
-        if (cur_block->magic != HEAP_MAGIC) {
-            LOG_ERR("HEAP Error: Heap corruption detected during traversal!");
-            return NULL;
-        }
+    if (size > HEAP_MAX_ALLOC) {
+        LOG_ERR("HEAP Error: Allocation of %d bytes is too large", size);
+        return NULL;
+    }
 
-        if (cur_block->free == 1 && cur_block->size >= aligned_size) {
-            break;
-        }
-        cur_block = cur_block->next;
+    size_t block_size = heap_block_size(size);
+    kuint32_t flags = interrupts_save();
+    heap_block_t* block = heap_take_block(block_size);
+    if (block == NULL) {
+        interrupts_restore(flags);
+        return NULL;
     }
 
-    // Time to expand the heap...
-    if(cur_block == NULL) {
-        size_t expansion_needed = aligned_size > heap_size / 4 ? aligned_size : heap_size / 4;
-        if (heap_expand(expansion_needed)) {
-            // Reattempt allocation...
-            heap_block_t* cur_block = heap_start;
-            while (cur_block != NULL) {
-                if (cur_block->magic != HEAP_MAGIC) {
-                    LOG_ERR("HEAP Error: Heap corruption detected during traversal!");
-                    return NULL;
-                }
-
-                if (cur_block->free == 1 && cur_block->size >= aligned_size) {
-                    break;
-                }
-                cur_block = cur_block->next;
-            }
-        } else {
-            LOG_ERR("HEAP Error: No suitable block found and expansion failed for size: %d", aligned_size);
-            return NULL;
-        }
-        LOG_ERR("HEAP Error: No suitable block found for size: %d", aligned_size);
+    heap_split(block, block_size);
+    heap_used += heap_block_size_of(block);
+    interrupts_restore(flags);
+
+    // Return pointer to memory after the header
+    return (generic_ptr)((virtual_addr_t)block + HEAP_HEADER_SIZE);
+}
+
+// The block is freed with kfree(). krealloc() keeps it aligned as long as it can resize it in place.
+generic_ptr kmalloc_aligned(size_t size, size_t align) {
+    if (align <= HEAP_ALIGN) {
+        return kmalloc(size);
+    }
+    if(heap_start == NULL) {
+        LOG_ERR("HEAP Error: Heap not initialized, you must initialize the heap before allocating");
+        return NULL;
+    }
+    if ((align & (align - 1)) || align > HEAP_MAX_ALLOC || size > HEAP_MAX_ALLOC - align) {
+        LOG_ERR("HEAP Error: Bad aligned allocation of %d bytes at alignment %d", size, align);
         return NULL;
     }
 
-    // Also return early if the current block doesn't have the correct magic number
-    if(cur_block->magic != HEAP_MAGIC) {
-        LOG_ERR("HEAP Error: Block corruption detected!");
+    // Ask for enough room to slide the payload up to the alignment. The gap in front becomes a free block of its
+    // own, so it has to be either empty or at least a minimum block, never a sliver.
+    size_t block_size = heap_block_size(size);
+    kuint32_t flags = interrupts_save();
+    heap_block_t* block = heap_take_block(block_size + align + HEAP_MIN_BLOCK_SIZE);
+    if (block == NULL) {
+        interrupts_restore(flags);
         return NULL;
     }
 
-    // If found block is much larger than needed, split it:
-    //  - Create a new block after the allocated space
-    //  - Set its size, next pointer, free flag, and magic
-    //  - Update the original block's size and next pointer
-#ifdef FIXED_MIN_BLOCK_SIZE
-    // Only split if we can reclaim at least 25% of the original block
-    if(cur_block->size >= aligned_size + (cur_block->size / 4)) {
-#else
-     // Only split if it would reclaim more than 128 bytes
-    if(cur_block->size >= aligned_size + MIN_BLOCK_SIZE) {
-#endif
-        // Address of new block
-        heap_block_t* new_block = (heap_block_t*)((virtual_addr_t)cur_block + aligned_size);
-
-        // Initialize new block
-        new_block->size = cur_block->size - aligned_size;
-        new_block->next = cur_block->next;
-        new_block->prev = cur_block;
-        new_block->free = 1;
-        new_block->magic = HEAP_MAGIC;
-        if (new_block->next) {
-            new_block->next->prev = new_block;
+    virtual_addr_t block_start = (virtual_addr_t)block;
+    virtual_addr_t payload = (block_start + HEAP_HEADER_SIZE + align - 1) & ~(align - 1);
+    size_t gap = payload - HEAP_HEADER_SIZE - block_start;
+    while (gap > 0 && gap < HEAP_MIN_BLOCK_SIZE) {
+        payload += align;
+        gap += align;
+    }
+    if (gap > 0) {
+        heap_block_t* aligned = (heap_block_t*)(block_start + gap);
+        aligned->size = heap_block_size_of(block) - gap;
+        aligned->magic = HEAP_MAGIC;
+        heap_set_size(block, gap);
+        if (block == heap_last) {
+            heap_last = aligned;
         }
+        heap_insert_free(block);
+        block = aligned;
+    }
 
-        // Update original block
-        cur_block->size = aligned_size;
-        cur_block->next = new_block;
+    heap_split(block, block_size);
+    heap_used += heap_block_size_of(block);
+    interrupts_restore(flags);
+    return (generic_ptr)payload;
+}
 
-        // Validate blocks to ensure correct splitting
-        if(cur_block->magic != HEAP_MAGIC || new_block->magic != HEAP_MAGIC) {
-            LOG_ERR("HEAP Error: Block corruption detected after split!");
-            return NULL;
-        }
+generic_ptr kcalloc(size_t count, size_t size) {
+    if (count != 0 && size > HEAP_MAX_ALLOC / count) {
+        LOG_ERR("HEAP Error: kcalloc of %d x %d bytes overflows", count, size);
+        return NULL;
     }
 
+    size_t total = count * size;
+    kuint8_t* ptr = kmalloc(total);
+    if (ptr == NULL) {
+        return NULL;
+    }
 
-    // Mark the found block as used (free = 0)
-    cur_block->free = 0;
-    
-    // Return pointer to memory after the header
-    return (generic_ptr)((virtual_addr_t)cur_block + sizeof(heap_block_t));
+    // Heap pages that aren't mapped have never been touched since they were reserved or trimmed, and are faulted
+    // in from zeroed frames, so only the pages already present need clearing
+    virtual_addr_t addr = (virtual_addr_t)ptr;
+    virtual_addr_t end = addr + total;
+    while (addr < end) {
+        virtual_addr_t chunk_end = (addr & PTE_FRAME) + PAGE_SIZE;
+        if (chunk_end > end) {
+            chunk_end = end;
+        }
+        kuint32_t frame;
+        if (vmm_get_frame(addr, &frame)) {
+            memset((generic_ptr)addr, 0, chunk_end - addr);
+        }
+        addr = chunk_end;
+    }
+    return ptr;
 }
 
 void kfree(generic_ptr ptr) {
@@ -160,46 +431,29 @@ void kfree(generic_ptr ptr) {
     }
 
     // Get the block header by subtracting header size from ptr
-    heap_block_t* block = (heap_block_t*)((virtual_addr_t)ptr - sizeof(heap_block_t));
+    heap_block_t* block = (heap_block_t*)((virtual_addr_t)ptr - HEAP_HEADER_SIZE);
 
     // Validate the block using magic number
     if (block->magic != HEAP_MAGIC) {
         LOG_ERR("HEAP Error: Invalid block header in kfree!");
         return;
     }
-
-    // Mark the block as free (free = 1)
-    block->free = 1;
-    
-    // Coalesce with next block if it's free:
-    //   - Check if next block exists and is free
-    //   - Check if blocks are contiguous in memory
-    //   - If so, merge them by adding sizes and updating next pointer
-    if(block->next != NULL && block->next->free == 1) {
-        virtual_addr_t block_end_addr = (virtual_addr_t)block + block->size;
-        if(block_end_addr == (virtual_addr_t)block->next) {
-            block->size = block->size + block->next->size;
-            block->next = block->next->next;
-            if (block->next) {
-                 block->next->prev = block;
-            }
-        }
+    if (block->size & HEAP_BLOCK_FREE) {
+        LOG_ERR("HEAP Error: Double free of 0x%x!", ptr);
+        return;
     }
-    
-    // Coalesce with previous block if it's free:
-    //   - Check if previous block is free and contiguous
-    //   - If so, merge them
-    if (block->prev && block->prev->free) {
-        virtual_addr_t block_prev_end_addr = (virtual_addr_t)block->prev + block->prev->size;
-        if(block_prev_end_addr == (virtual_addr_t)block) {
-            block->prev->size += block->size;
-            block->prev->next = block->next;
-            if (block->next) {
-                  block->prev = block;
-            }
-            block = block->prev;
-        }
+
+    // Merge with the free neighbours in memory and put the result on its free list
+    kuint32_t flags = interrupts_save();
+    virtual_addr_t trim_start = heap_trim_start(block);
+    virtual_addr_t trim_end = heap_trim_end(block);
+    heap_used -= heap_block_size_of(block);
+    block = heap_coalesce(block);
+    heap_insert_free(block);
+    if (heap_block_size_of(block) >= HEAP_TRIM_THRESHOLD) {
+        heap_trim(block, trim_start, trim_end);
     }
+    interrupts_restore(flags);
 }
 
 generic_ptr krealloc(generic_ptr ptr, size_t size) {
@@ -212,32 +466,57 @@ generic_ptr krealloc(generic_ptr ptr, size_t size) {
         kfree(ptr);
         return NULL;
     }
-    
+
     // Get the block header and validate it
-    heap_block_t* block = (heap_block_t*)((virtual_addr_t)ptr - sizeof(heap_block_t));
-    if(block->magic != HEAP_MAGIC) {
+    heap_block_t* block = (heap_block_t*)((virtual_addr_t)ptr - HEAP_HEADER_SIZE);
+    if(block->magic != HEAP_MAGIC || (block->size & HEAP_BLOCK_FREE)) {
         LOG_ERR("HEAP Error: Invalid block header in krealloc!");
         return NULL;
     }
-    
-    // Calculate current payload size (block size - header size)
-    size_t payload_size = block->size - sizeof(heap_block_t);
+    if (size > HEAP_MAX_ALLOC) {
+        LOG_ERR("HEAP Error: Allocation of %d bytes is too large", size);
+        return NULL;
+    }
+
+    size_t old_size = heap_block_size_of(block);
+    size_t new_size = heap_block_size(size);
+    kuint32_t flags = interrupts_save();
+
+    // A block at the end of the heap can grow into a fresh expansion
+    if (new_size > old_size && block == heap_last) {
+        heap_expand(new_size - old_size);
+    }
+
+    // Grow into a free successor when together they are large enough
+    heap_block_t* next = heap_next_block(block);
+    if (new_size > old_size && next && (next->size & HEAP_BLOCK_FREE) && old_size + heap_block_size_of(next) >= new_size) {
+        heap_remove_free(next);
+        heap_set_size(block, old_size + heap_block_size_of(next));
+        if (next == heap_last) {
+            heap_last = block;
+        }
+    }
 
-    // If new size is smaller or equal to current size, return same pointer
-    if(payload_size <= block->size) {
+    // Shrink or trim in place, the tail goes back to the free lists. A tail cut off the old data may be large enough
+    // to trim, one left over from a grown into neighbour was trimmed with it.
+    if (new_size <= heap_block_size_of(block)) {
+        virtual_addr_t trim_end = heap_trim_end(block);
+        heap_split(block, new_size);
+        heap_block_t* rest = heap_next_block(block);
+        if (new_size < old_size && rest && (rest->size & HEAP_BLOCK_FREE) && heap_block_size_of(rest) >= HEAP_TRIM_THRESHOLD) {
+            heap_trim(rest, (virtual_addr_t)block + new_size, trim_end);
+        }
+        heap_used += heap_block_size_of(block) - old_size;
+        interrupts_restore(flags);
         return ptr;
     }
-    
-    // Otherwise:
-    //   - Allocate new block with kmalloc(size)
-    //   - Copy data from old block to new block using memcpy
-    //   - Free old block with kfree
-    //   - Return new pointer
+    interrupts_restore(flags);
+
+    // Otherwise move the data to a new block
     generic_ptr new_block = kmalloc(size);
     if(new_block) {
-        size_t copy_size = payload_size < size ? payload_size : size;
-        memcpy(new_block, block, copy_size);
-        kfree(block);
+        memcpy(new_block, ptr, old_size - HEAP_HEADER_SIZE);
+        kfree(ptr);
     }
     return new_block;
 }
@@ -247,49 +526,24 @@ bool heap_expand(size_t additional_size) {
     size_t pages_needed = (additional_size + PAGE_SIZE - 1) / PAGE_SIZE;
     size_t expansion_size = pages_needed * PAGE_SIZE;
 
-    // Find the last block
-    heap_block_t* last_block = heap_start;
-    while (last_block && last_block->next) {
-        last_block = last_block->next;
-    }
-
     // Get the end address of the current heap
     virtual_addr_t current_heap_end = heap_virtual_start + heap_size;
 
-    // Map all the new pages
-    for (size_t i = 0; i < expansion_size; i += PAGE_SIZE) {
-        virtual_addr_t addr = current_heap_end + i;
-        physical_addr_t block = (physical_addr_t)pmm_alloc_block();
-        if(!block) {
-            LOG_ERR("HEAP Error: Failed to allocate physical memory for heap in expansion");
-            return false;
-        }
-        vmm_map_page(addr, block, (PTE_PRESENT | PTE_READ_WRITE));
+    // Reserve all the new pages
+    if (!heap_reserve_pages(current_heap_end, expansion_size)) {
+        LOG_ERR("HEAP Error: Failed to reserve virtual memory for heap in expansion");
+        return false;
     }
 
-    // Create a new free block at the end of the expanded heap
+    // Create a new block at the end of the expanded heap, merged into the last block if that one is free
+    kuint32_t flags = interrupts_save();
     heap_block_t* new_block = (heap_block_t*)current_heap_end;
-    new_block->size = expansion_size;
-    new_block->next = NULL;
-    new_block->prev = last_block;
-    new_block->free = 1;
+    new_block->size = expansion_size | (heap_last->size & HEAP_BLOCK_FREE ? HEAP_BLOCK_PREV_FREE : 0);
     new_block->magic = HEAP_MAGIC;
-
-    if(last_block) {
-        last_block->next = new_block;
-    }
-
-    // Update heap size
     heap_size += expansion_size;
-
-    // Coalesce with previous block if it is free
-    if(last_block && last_block->free) {
-        virtual_addr_t last_block_end = (virtual_addr_t)last_block + last_block->size;
-        if(last_block_end == (virtual_addr_t)new_block) {
-            last_block->size += new_block->size;
-            last_block->next = NULL;
-        }
-    }
+    heap_last = new_block;
+    heap_insert_free(heap_coalesce(new_block));
+    interrupts_restore(flags);
 
     return true;
 }
@@ -304,16 +558,9 @@ size_t heap_get_free_size() {
 }
 
 size_t heap_get_used_size() {
-    if (!heap_start) return 0;
-
-    size_t used = 0;
-    heap_block_t* cur = heap_start;
-    while(cur != NULL) {
-        if(cur->magic == HEAP_MAGIC && cur->free == 0) {
-            used += cur->size;
-        }
-        cur = cur->next;
-    }
+    return heap_used;
+}
 
-    return used;
-}
\ No newline at end of file
+kuint32_t heap_get_trimmed_pages() {
+    return heap_trimmed_pages;
+}
@@ -40,15 +40,32 @@ void kernel_main(kuint32_t magic, kuint32_t multiboot_addr) {
     tss_init();
     idt_init();
     pic_remap(0x20, 0x28);
+    tsc_calibrate();
 
-    // Phase 2: Memory management
+    // Phase 2: Memory management, the paging mode decides how much memory the PMM tracks
+    vmm_select_paging_mode(mbi);
     pmm_init_status_t pmm_status = pmm_init(mbi);
     vmm_init_status_t vmm_status = vmm_init(mbi);
+    if (!vmm_status.is_init) {
+        LOG_ERR("FATAL: Paging could not be set up!");
+        return;
+    }
+    // The heap is faulted in lazily, so the page fault handler has to be in place before it
+    register_interrupt_handler(0x0E, page_fault_handler);
     heap_init(HEAP_VIRTUAL_START, HEAP_SIZE);
+#ifdef DEBUG
+    test_pmm_buddy();
+    test_kmem_cache();
+#ifdef BENCHMARK
+    bench_pmm_alloc(&pmm_status);
+    bench_context_switch();
+    bench_vmm_map();
+    bench_kmalloc();
+#endif
+#endif
 
     //TODO: remove
     (void)pmm_status;
-    (void)vmm_status;
 
     // Phase 3: Subsystems and drivers and timers
     cmos_time_t current_time = time_init();
@@ -62,7 +79,6 @@ void kernel_main(kuint32_t magic, kuint32_t multiboot_addr) {
 
     // Register interrupt handlers BEFORE enabling interrupts.
     // The device initialization will happen inside their respective processes.
-    register_interrupt_handler(0x0E, page_fault_handler);
     register_interrupt_handler(0x0D, general_protection_fault_handler);
     register_interrupt_handler(0x21, keyboard_handler);
     register_interrupt_handler(0x2C, mouse_handler);
@@ -82,6 +98,14 @@ void kernel_main(kuint32_t magic, kuint32_t multiboot_addr) {
     // Create a test user mode program here
     create_user_process();
     create_user_process_syscall_exit();
+#ifdef DEBUG
+    test_vmm_vmas();
+    test_fork_cow();
+    debug_vmalloc();
+#ifdef BENCHMARK
+    bench_fork();
+#endif
+#endif
 
     // Enable interrupts now that all handlers are registered.
     asm volatile("sti");
@@ -91,6 +115,16 @@ void kernel_main(kuint32_t magic, kuint32_t multiboot_addr) {
     // All other work is done by scheduled processes or interrupt handlers.
     while(1) {
         text_mode_console_refresh();
+        // Free the memory of processes that have exited since the last pass
+#ifdef DEBUG
+        if (proc_reap() > 0) {
+            debug_proc_reaper();
+        }
+#else
+        proc_reap();
+#endif
+        // Use spare cycles to zero frames ahead of page table and process allocations
+        pmm_zero_pool_refill();
         // vfs_write(1, "Hello from proc 0", 19);
         asm volatile("hlt");
     }
@@ -1,7 +1,8 @@
 #include <kernel/proc.h>
-#include <kernel/heap.h>
+#include <kernel/vmalloc.h>
 #include <kernel/log.h>
 #include <kernel/vfs.h>
+#include <kernel/sync.h>
 #include <libc/strings.h>
 #include <arch/i386/vmm.h>
 #include <arch/i386/gdt.h>
@@ -12,6 +13,18 @@ static kuint32_t next_pid = 1;
 static kuint32_t current_process_index = 0;
 static bool init_done = false;
 
+// Processes that exited but still hold their memory and slot
+static kuint32_t zombie_count = 0;
+static kuint32_t reaped_count = 0;
+static kuint32_t pages_reclaimed = 0;
+
+// Kernel stacks of reaped processes, handed to the next process created
+static struct {
+    generic_ptr stacks[PROC_KSTACK_CACHE_SIZE];
+    kuint32_t count;
+    kuint32_t hits, misses;
+} kstack_cache;
+
 static const char* proc_type_names[] = {
     [KERNEL_PROC] = "Kernel Process",
     [USER_PROC] = "User Process",
@@ -40,6 +53,26 @@ static unsigned char user_program_syscall_exit[] = {
     0xEB, 0xFE                     // jmp $
 };
 
+// Both are called with interrupts off. Stacks come from vmalloc, so an overflow runs into a guard page instead of
+// whatever sits below the stack. There is no double fault task gate, so that resets the machine rather than
+// reaching the page fault handler.
+static generic_ptr proc_alloc_kernel_stack() {
+    if (kstack_cache.count > 0) {
+        kstack_cache.hits++;
+        return kstack_cache.stacks[--kstack_cache.count];
+    }
+    kstack_cache.misses++;
+    return vmalloc(KERNEL_STACK_SIZE);
+}
+
+static void proc_free_kernel_stack(generic_ptr stack) {
+    if (kstack_cache.count < PROC_KSTACK_CACHE_SIZE) {
+        kstack_cache.stacks[kstack_cache.count++] = stack;
+    } else {
+        vfree(stack);
+    }
+}
+
 static process_t* _proc_create_internal(bool restore_interrupts, proc_type_t kind, proc_entry_point_t kernel_entry, unsigned char* user_code, size_t user_size) {
     asm volatile("cli"); // Critical section
 
@@ -72,7 +105,7 @@ static process_t* _proc_create_internal(bool restore_interrupts, proc_type_t kin
     LOG_DEBUG("PROC: Using slot %d\n", proc_idx);
 
     // Allocate a kernel stack
-    proc->kernel_stack = kmalloc(KERNEL_STACK_SIZE);
+    proc->kernel_stack = proc_alloc_kernel_stack();
     if (!proc->kernel_stack) {
         LOG_ERR("PROC: Failed to allocate kernel stack.\n");
         if(restore_interrupts) {
@@ -87,7 +120,7 @@ static process_t* _proc_create_internal(bool restore_interrupts, proc_type_t kin
         proc->page_directory = vmm_create_user_directory();
         if (!proc->page_directory) {
             LOG_ERR("PROC: Failed to create user page directory.\n");
-            kfree(proc->kernel_stack);
+            proc_free_kernel_stack(proc->kernel_stack);
             proc->used = false;
             if(restore_interrupts) {
                 asm volatile("sti");
@@ -106,34 +139,40 @@ static process_t* _proc_create_internal(bool restore_interrupts, proc_type_t kin
     memcpy(proc->open_files, parent->open_files, sizeof(parent->open_files));
 
     // Allocate and map user memory if needed
+    proc->vmas.count = 0;
+    proc->minor_faults = 0;
     kuint32_t user_stack_top = 0;
     if (kind == USER_PROC && user_code && user_size > 0) {
-        physical_addr_t code_phys = (physical_addr_t)pmm_alloc_block();
-        physical_addr_t stack_phys = (physical_addr_t)pmm_alloc_block();
+        // The code frame comes zeroed so nothing stale leaks into user space. It can sit anywhere in physical
+        // memory, the code is copied in through a temporary mapping.
+        kuint32_t code_frame = pmm_alloc_zeroed_frame(PMM_ZONE_HIGH64);
+        generic_ptr code_window = code_frame != PMM_NO_FRAME ? vmm_kmap(code_frame) : NULL;
 
-        if (!code_phys || !stack_phys) {
+        if (!code_window) {
             LOG_ERR("PROC: Failed to allocate user memory.\n");
-            if (code_phys) pmm_free_block((generic_ptr)code_phys);
-            if (stack_phys) pmm_free_block((generic_ptr)stack_phys);
-            kfree(proc->kernel_stack);
+            if (code_frame != PMM_NO_FRAME) pmm_free_frame(code_frame);
+            proc_free_kernel_stack(proc->kernel_stack);
             proc->used = false;
             if(restore_interrupts) {
                 asm volatile("sti");
             }
             return NULL;
         }
+        pmm_frame_page(code_frame)->flags |= PMM_PAGE_ANON;
 
-        virtual_addr_t code_virt = 0x1000000;
-        virtual_addr_t stack_virt = 0x1080000;
-        user_stack_top = stack_virt + PMM_BLOCK_SIZE;
+        virtual_addr_t code_virt = USER_CODE_VIRTUAL_START;
+        virtual_addr_t stack_virt = USER_STACK_VIRTUAL_START;
+        user_stack_top = stack_virt + USER_STACK_SIZE;
         user_stack_top &= ~0xF;
 
-        // Map pages
-        vmm_map_page_dir(proc->page_directory, code_virt, code_phys, PTE_PRESENT | PTE_USER);
-        vmm_map_page_dir(proc->page_directory, stack_virt, stack_phys, PTE_PRESENT | PTE_USER | PTE_READ_WRITE);
+        // Map the code, the stack gets its frames on first touch
+        vmm_vma_insert(&proc->vmas, code_virt, PAGE_SIZE, VMA_READ | VMA_EXEC | VMA_USER, VMA_IMAGE);
+        vmm_vma_insert(&proc->vmas, stack_virt, USER_STACK_SIZE, VMA_READ | VMA_WRITE | VMA_USER, VMA_ANONYMOUS);
+        vmm_map_frame(proc->page_directory, code_virt, code_frame, PTE_PRESENT | PTE_USER);
 
         // Copy user code into memory
-        memcpy((char*)code_phys, user_code, user_size);
+        memcpy(code_window, user_code, user_size);
+        vmm_kunmap(code_window);
 
         LOG_DEBUG("PROC: User code mapped at 0x%x, stack at 0x%x\n", code_virt, stack_virt);
     }
@@ -158,7 +197,7 @@ static process_t* _proc_create_internal(bool restore_interrupts, proc_type_t kin
         kstack_ptr -= sizeof(kuint32_t); *((kuint32_t*)kstack_ptr) = 0; // error code
 
         // Push IRET frame
-        kuint32_t user_entry = 0x1000000;
+        kuint32_t user_entry = USER_CODE_VIRTUAL_START;
         kstack_ptr -= sizeof(kuint32_t); *((kuint32_t*)kstack_ptr) = 0x23;      // SS
         kstack_ptr -= sizeof(kuint32_t); *((kuint32_t*)kstack_ptr) = user_stack_top; // ESP
         kstack_ptr -= sizeof(kuint32_t); *((kuint32_t*)kstack_ptr) = 0x202;    // EFLAGS
@@ -196,7 +235,9 @@ static process_t* _proc_create_internal(bool restore_interrupts, proc_type_t kin
               (kind == USER_PROC) ? "User" : "Kernel",
               proc->process_id);
 
-    asm volatile("sti");
+    if(restore_interrupts) {
+        asm volatile("sti");
+    }
     return proc;
 }
 
@@ -237,6 +278,85 @@ process_t* proc_create(proc_entry_point_t entry_point, bool restore_interrupts)
     return proc;
 }
 
+process_t* proc_create_user(unsigned char* user_code, size_t user_size, bool restore_interrupts) {
+    return _proc_create_internal(restore_interrupts, USER_PROC, NULL, user_code, user_size);
+}
+
+process_t* proc_clone(process_t* parent, registers_t* regs) {
+    if (!parent || parent->proc_type != USER_PROC) {
+        LOG_ERR("PROC: Only user processes can fork!\n");
+        return NULL;
+    }
+
+    kuint32_t flags = interrupts_save();
+    process_t* child = NULL;
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        if (!process_table[i].used) {
+            child = &process_table[i];
+            break;
+        }
+    }
+    if (!child) {
+        LOG_ERR("PROC: No free process slots!\n");
+        interrupts_restore(flags);
+        return NULL;
+    }
+
+    child->kernel_stack = proc_alloc_kernel_stack();
+    if (!child->kernel_stack) {
+        LOG_ERR("PROC: Failed to allocate kernel stack.\n");
+        interrupts_restore(flags);
+        return NULL;
+    }
+    child->kernel_stack_size = KERNEL_STACK_SIZE;
+
+    // The user pages are shared copy-on-write, so forking costs page tables rather than a copy of the image
+    child->page_directory = vmm_clone_directory(parent->page_directory, &parent->vmas);
+    if (!child->page_directory) {
+        LOG_ERR("PROC: Failed to clone the page directory.\n");
+        proc_free_kernel_stack(child->kernel_stack);
+        interrupts_restore(flags);
+        return NULL;
+    }
+    memcpy(child->open_files, parent->open_files, sizeof(parent->open_files));
+    child->vmas = parent->vmas;
+    child->minor_faults = 0;
+
+    // The child resumes from the parent's interrupt frame, with fork returning 0
+    registers_t* child_regs = (registers_t*)((char*)child->kernel_stack + KERNEL_STACK_SIZE - sizeof(registers_t));
+    *child_regs = *regs;
+    child_regs->eax = 0;
+    child->esp = (kuint32_t)child_regs;
+
+    child->process_id = next_pid++;
+    child->parent_proc_id = parent->process_id;
+    child->current_state = RUNNING;
+    child->proc_type = USER_PROC;
+    child->used = true;
+
+    interrupts_restore(flags);
+    return child;
+}
+
+void proc_destroy(process_t* proc) {
+    if (!proc || proc == proc_get_current() || proc == &process_table[0]) {
+        LOG_ERR("PROC: Can't destroy the running process or the idle task!\n");
+        return;
+    }
+
+    kuint32_t flags = interrupts_save();
+    if (proc->proc_type == USER_PROC) {
+        pages_reclaimed += vmm_destroy_user_directory(proc->page_directory);
+    }
+    proc_free_kernel_stack(proc->kernel_stack);
+    if (proc->current_state == EXITED) {
+        zombie_count--;
+    }
+    proc->current_state = STOPPED;
+    proc->used = false;
+    interrupts_restore(flags);
+}
+
 void create_user_process() {
     LOG_DEBUG("-- Creating User Process --\n");
 
@@ -266,11 +386,59 @@ process_t* proc_get_current() {
     return &process_table[current_process_index];
 }
 
+// Makes a process current and switches to its address space without scheduling it, the caller keeps running on
+// its own kernel stack. Faults are then resolved against that process' areas. Returns the previous process so
+// the caller can enter it again, interrupts have to be off in between.
+process_t* proc_enter(process_t* proc) {
+    process_t* previous = proc_get_current();
+    current_process_index = proc - process_table;
+    load_page_directory(proc->page_directory);
+    return previous;
+}
+
 void proc_terminate(process_t* proc) {
-    if(proc) {
+    // The process may still be running on its kernel stack and address space, so it only becomes a zombie
+    // here and the reaper frees it once it has been switched away from
+    if(proc && proc->current_state != EXITED) {
+        kuint32_t flags = interrupts_save();
         proc->current_state = EXITED;
-        // In a more advanced kernel, we would free memory, close files, etc...
+        zombie_count++;
+        interrupts_restore(flags);
+        LOG_DEBUG("PROC: PID %d exited after %d minor faults\n", proc->process_id, proc->minor_faults);
+    }
+}
+
+kuint32_t proc_reap() {
+    if (!init_done || zombie_count == 0) {
+        return 0;
     }
+
+    // Runs from the idle task, which is on the kernel directory, so no zombie's address space is active
+    kuint32_t reaped = 0;
+    kuint32_t pages_before = pages_reclaimed;
+    for (int i = 1; i < MAX_PROCESSES && reaped < PROC_REAP_BATCH; i++) {
+        process_t* proc = &process_table[i];
+        if (proc->used && proc->current_state == EXITED && proc != proc_get_current()) {
+            proc_destroy(proc);
+            reaped++;
+        }
+    }
+    reaped_count += reaped;
+    if (reaped > 0) {
+        LOG_DEBUG("PROC: Reaped %d processes, %d pages reclaimed\n", reaped, pages_reclaimed - pages_before);
+    }
+    return reaped;
+}
+
+void proc_get_reaper_stats(proc_reaper_stats_t* stats) {
+    kuint32_t flags = interrupts_save();
+    stats->zombies = zombie_count;
+    stats->reaped = reaped_count;
+    stats->pages_reclaimed = pages_reclaimed;
+    stats->stack_cache_hits = kstack_cache.hits;
+    stats->stack_cache_misses = kstack_cache.misses;
+    stats->cached_stacks = kstack_cache.count;
+    interrupts_restore(flags);
 }
 
 void proc_scheduler_run(registers_t *regs) {
@@ -0,0 +1,241 @@
+#include <kernel/slab.h>
+#include <kernel/log.h>
+#include <kernel/sync.h>
+#include <kernel/vmalloc.h>
+#include <arch/i386/pmm.h>
+
+static kmem_cache_t caches[KMEM_MAX_CACHES];
+
+static void kmem_list_push(kmem_slab_t** list, kmem_slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void kmem_list_remove(kmem_slab_t** list, kmem_slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+}
+
+// Where the objects start in a slab holding 'count' of them
+static virtual_addr_t kmem_objects_offset(kuint32_t count, size_t align) {
+    virtual_addr_t offset = sizeof(kmem_slab_t) + count * sizeof(kuint16_t);
+    return (offset + align - 1) & ~(align - 1);
+}
+
+// The descriptor of the frame behind an object, slab frames point back at their slab through private_data
+static pmm_page_t* kmem_object_page(generic_ptr object) {
+    kuint32_t frame;
+    if ((virtual_addr_t)object < VMALLOC_VIRTUAL_START || (virtual_addr_t)object >= VMALLOC_VIRTUAL_END ||
+        !vmm_get_frame((virtual_addr_t)object, &frame)) {
+        return NULL;
+    }
+    return pmm_frame_page(frame);
+}
+
+// Each slab is a page of its own from vmalloc(), so its frame can come from any zone instead of the small DMA zone
+// that drivers need. The guard page in front of it also catches overruns from the slab below.
+static kmem_slab_t* kmem_slab_create(kmem_cache_t* cache) {
+    kmem_slab_t* slab = vmalloc(PAGE_SIZE);
+    if (slab == NULL) {
+        return NULL;
+    }
+    pmm_page_t* page = kmem_object_page(slab);
+    if (page == NULL) {
+        vfree(slab);
+        return NULL;
+    }
+    page->private_data = (kuint32_t)slab;
+
+    slab->magic = KMEM_SLAB_MAGIC;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->objects = (generic_ptr)((virtual_addr_t)slab + kmem_objects_offset(cache->objects_per_slab, cache->align));
+    for (kuint32_t i = 0; i < cache->objects_per_slab; i++) {
+        slab->next_free[i] = (i + 1 < cache->objects_per_slab) ? i + 1 : KMEM_FREE_END;
+        if (cache->ctor) {
+            cache->ctor((generic_ptr)((virtual_addr_t)slab->objects + i * cache->stride));
+        }
+    }
+    slab->free_head = 0;
+    cache->slabs++;
+    return slab;
+}
+
+static void kmem_slab_destroy(kmem_cache_t* cache, kmem_slab_t* slab) {
+    slab->magic = 0;
+    cache->slabs--;
+    kmem_object_page(slab)->private_data = 0;
+    vfree(slab);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor) {
+    if (align < KMEM_MIN_ALIGN) {
+        align = KMEM_MIN_ALIGN;
+    }
+    if (size == 0 || size > KMEM_MAX_OBJECT_SIZE || (align & (align - 1)) || align > KMEM_MAX_OBJECT_SIZE) {
+        LOG_ERR("KMEM Error: Bad object size %d or alignment %d for cache %s", size, align, name);
+        return NULL;
+    }
+
+    kuint32_t flags = interrupts_save();
+    kmem_cache_t* cache = NULL;
+    for (kuint32_t i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!caches[i].used) {
+            cache = &caches[i];
+            break;
+        }
+    }
+    if (!cache) {
+        interrupts_restore(flags);
+        LOG_ERR("KMEM Error: No free cache slots for %s", name);
+        return NULL;
+    }
+
+    // Fit as many objects as the page holds next to the header and one free list link per object
+    size_t stride = (size + align - 1) & ~(align - 1);
+    kuint32_t count = (PAGE_SIZE - sizeof(kmem_slab_t)) / (stride + sizeof(kuint16_t));
+    while (count > 0 && kmem_objects_offset(count, align) + count * stride > PAGE_SIZE) {
+        count--;
+    }
+
+    memset(cache, 0, sizeof(kmem_cache_t));
+    cache->name = name;
+    cache->object_size = size;
+    cache->align = align;
+    cache->stride = stride;
+    cache->objects_per_slab = count;
+    cache->ctor = ctor;
+    cache->used = true;
+    interrupts_restore(flags);
+    return cache;
+}
+
+bool kmem_cache_destroy(kmem_cache_t* cache) {
+    kuint32_t flags = interrupts_save();
+    if (cache->active_objects > 0) {
+        interrupts_restore(flags);
+        LOG_ERR("KMEM Error: Cache %s still has %d objects in use!", cache->name, cache->active_objects);
+        return false;
+    }
+
+    kmem_cache_shrink(cache);
+    cache->used = false;
+    interrupts_restore(flags);
+    return true;
+}
+
+generic_ptr kmem_cache_alloc(kmem_cache_t* cache) {
+    kuint32_t flags = interrupts_save();
+
+    // Fill partial slabs first so empty ones can be given back, then reuse an empty slab, then grow
+    kmem_slab_t* slab = cache->partial;
+    if (!slab && cache->empty) {
+        slab = cache->empty;
+        kmem_list_remove(&cache->empty, slab);
+        cache->empty_slabs--;
+        kmem_list_push(&cache->partial, slab);
+    }
+    if (!slab) {
+        slab = kmem_slab_create(cache);
+        if (!slab) {
+            interrupts_restore(flags);
+            LOG_ERR("KMEM Error: Out of memory growing cache %s", cache->name);
+            return NULL;
+        }
+        kmem_list_push(&cache->partial, slab);
+    }
+
+    kuint16_t index = slab->free_head;
+    slab->free_head = slab->next_free[index];
+    slab->in_use++;
+    cache->active_objects++;
+    if (slab->free_head == KMEM_FREE_END) {
+        kmem_list_remove(&cache->partial, slab);
+        kmem_list_push(&cache->full, slab);
+    }
+
+    interrupts_restore(flags);
+    return (generic_ptr)((virtual_addr_t)slab->objects + index * cache->stride);
+}
+
+void kmem_cache_free(kmem_cache_t* cache, generic_ptr object) {
+    if (object == NULL) {
+        return;
+    }
+
+    pmm_page_t* page = kmem_object_page(object);
+    kmem_slab_t* slab = page ? (kmem_slab_t*)page->private_data : NULL;
+    virtual_addr_t offset = slab ? (virtual_addr_t)object - (virtual_addr_t)slab->objects : 0;
+    if (!slab || slab->magic != KMEM_SLAB_MAGIC || slab->cache != cache ||
+        (virtual_addr_t)object < (virtual_addr_t)slab->objects || offset % cache->stride != 0) {
+        LOG_ERR("KMEM Error: 0x%x doesn't belong to cache %s!", object, cache->name);
+        return;
+    }
+
+    kuint32_t flags = interrupts_save();
+    kuint16_t index = offset / cache->stride;
+    bool was_full = slab->free_head == KMEM_FREE_END;
+    slab->next_free[index] = slab->free_head;
+    slab->free_head = index;
+    slab->in_use--;
+    cache->active_objects--;
+
+    if (was_full) {
+        kmem_list_remove(&cache->full, slab);
+        kmem_list_push(&cache->partial, slab);
+    }
+    if (slab->in_use == 0) {
+        kmem_list_remove(&cache->partial, slab);
+        if (cache->empty_slabs < KMEM_MAX_EMPTY_SLABS) {
+            kmem_list_push(&cache->empty, slab);
+            cache->empty_slabs++;
+        } else {
+            kmem_slab_destroy(cache, slab);
+        }
+    }
+    interrupts_restore(flags);
+}
+
+void kmem_cache_shrink(kmem_cache_t* cache) {
+    kuint32_t flags = interrupts_save();
+    while (cache->empty) {
+        kmem_slab_t* slab = cache->empty;
+        kmem_list_remove(&cache->empty, slab);
+        kmem_slab_destroy(cache, slab);
+    }
+    cache->empty_slabs = 0;
+    interrupts_restore(flags);
+}
+
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+    kuint32_t flags = interrupts_save();
+    stats->name = cache->name;
+    stats->object_size = cache->object_size;
+    stats->slabs = cache->slabs;
+    stats->objects_per_slab = cache->objects_per_slab;
+    stats->active_objects = cache->active_objects;
+    stats->total_objects = cache->slabs * cache->objects_per_slab;
+    stats->occupancy_pct = stats->total_objects ? stats->active_objects * 100 / stats->total_objects : 0;
+    interrupts_restore(flags);
+}
+
+kuint32_t kmem_get_all_stats(kmem_cache_stats_t* stats, kuint32_t max) {
+    kuint32_t count = 0;
+    for (kuint32_t i = 0; i < KMEM_MAX_CACHES && count < max; i++) {
+        if (caches[i].used) {
+            kmem_cache_get_stats(&caches[i], &stats[count++]);
+        }
+    }
+    return count;
+}
@@ -29,4 +29,25 @@ void spinlock_release(spinlock_t* lock) {
         asm volatile("sti");
         restore_interrupts = false;
     }
+}
+
+// Disables interrupts and returns the previous EFLAGS so that interrupts_restore() can undo it. Unlike the
+// spinlocks this nests, so it is safe to use from paths that may already run with interrupts off.
+kuint32_t interrupts_save() {
+    kuint32_t flags;
+    asm volatile (
+        "pushfl \n"
+        "popl %0 \n"
+        "cli"
+        : "=r" (flags)
+        :
+        : "memory"
+    );
+    return flags;
+}
+
+void interrupts_restore(kuint32_t flags) {
+    if (flags & (1 << 9)) {
+        asm volatile("sti" : : : "memory");
+    }
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <kernel/log.h>
 #include <kernel/sync.h>
 #include <libc/sysstd.h>
+#include <kernel/kernel_layout.h>
+#include <arch/i386/pmm.h>
 
 void syscall_handler(registers_t *regs) {
     kuint32_t syscall = regs->eax;
@@ -14,12 +16,24 @@ void syscall_handler(registers_t *regs) {
         case SYSCALL_PROC_EXIT:
             sys_exit(regs);
             break;
+        case SYSCALL_PROC_FORK:
+            sys_fork(regs);
+            break;
         case SYSCALL_PROC_PID:
             sys_pid(regs);
             break;
         case SYSCALL_VFS_WRITE:
             sys_vfs_write(regs);
             break;
+        case SYSCALL_MEM_MMAP:
+            sys_mmap(regs);
+            break;
+        case SYSCALL_MEM_MUNMAP:
+            sys_munmap(regs);
+            break;
+        case SYSCALL_MEM_MPROTECT:
+            sys_mprotect(regs);
+            break;
         default:
             LOG_ERR("Unknown syscall: %d", syscall);
             break;
@@ -37,6 +51,11 @@ void sys_exit(registers_t *regs) {
     proc_scheduler_run(regs);
 }
 
+void sys_fork(registers_t *regs) {
+    process_t* child = proc_clone(proc_get_current(), regs);
+    regs->eax = child ? child->process_id : (kuint32_t)-1;
+}
+
 void sys_pid(registers_t *regs) {
     LOG_INFO("Process has requested current PID");
     process_t *current_proc = proc_get_current();
@@ -64,4 +83,95 @@ void sys_vfs_write(registers_t *regs) {
         regs->eax = -1;
     }
     return;
+}
+
+// Memory syscalls only act on user processes and on page aligned ranges between the user code and the kernel half
+static process_t* sys_mem_process(virtual_addr_t addr, size_t length) {
+    process_t* proc = proc_get_current();
+    if (!proc || proc->proc_type != USER_PROC || length == 0 || (addr & (PAGE_SIZE - 1))) {
+        return NULL;
+    }
+    if (addr < USER_CODE_VIRTUAL_START || (kuint64_t)addr + length > KERNEL_VIRTUAL_BASE) {
+        return NULL;
+    }
+    return proc;
+}
+
+void sys_mmap(registers_t *regs) {
+    virtual_addr_t hint = regs->ebx;
+    size_t length = (regs->ecx + PAGE_SIZE - 1) & PTE_FRAME;
+    kuint32_t prot = regs->edx & (PROT_READ | PROT_WRITE | PROT_EXEC);
+    kuint32_t flags = regs->esi;
+    regs->eax = (kuint32_t)MAP_FAILED;
+
+    process_t* proc = proc_get_current();
+    if (!proc || proc->proc_type != USER_PROC || length == 0 || !(flags & MAP_PRIVATE) == !(flags & MAP_SHARED)) {
+        return;
+    }
+
+    // A fixed mapping has to go exactly where it was asked for, a hint is only a preference
+    virtual_addr_t addr;
+    if (flags & MAP_FIXED) {
+        if (!sys_mem_process(hint, length)) {
+            return;
+        }
+        addr = vmm_vma_find_free(&proc->vmas, hint, length, hint, hint + length);
+    } else {
+        addr = vmm_vma_find_free(&proc->vmas, hint, length, USER_MMAP_VIRTUAL_START, KERNEL_VIRTUAL_BASE);
+    }
+    if (addr == 0) {
+        return;
+    }
+
+    // PROT_* match the VMA access bits
+    kuint32_t vma_prot = prot | VMA_USER | ((flags & MAP_SHARED) ? VMA_SHARED : 0);
+    if (!vmm_vma_insert(&proc->vmas, addr, length, vma_prot, VMA_ANONYMOUS)) {
+        return;
+    }
+
+    // Private memory is faulted in lazily. Shared memory is populated now, so the frames exist before a fork
+    // hands them to the child.
+    if (flags & MAP_SHARED) {
+        kuint32_t pte_flags = vmm_vma_pte_flags(vmm_vma_find(&proc->vmas, addr));
+        for (size_t offset = 0; offset < length; offset += PAGE_SIZE) {
+            kuint32_t frame = pmm_alloc_zeroed_frame(PMM_ZONE_HIGH64);
+            if (frame == PMM_NO_FRAME) {
+                vmm_free_range(proc->page_directory, addr, offset / PAGE_SIZE);
+                vmm_vma_remove(&proc->vmas, addr, length);
+                return;
+            }
+            pmm_frame_page(frame)->flags |= PMM_PAGE_ANON;
+            vmm_map_frame(proc->page_directory, addr + offset, frame, pte_flags);
+        }
+    }
+    regs->eax = addr;
+}
+
+void sys_munmap(registers_t *regs) {
+    virtual_addr_t addr = regs->ebx;
+    size_t length = (regs->ecx + PAGE_SIZE - 1) & PTE_FRAME;
+    process_t* proc = sys_mem_process(addr, length);
+    if (!proc || !vmm_vma_remove(&proc->vmas, addr, length)) {
+        regs->eax = (kuint32_t)-1;
+        return;
+    }
+
+    vmm_free_range(proc->page_directory, addr, length / PAGE_SIZE);
+    regs->eax = 0;
+}
+
+void sys_mprotect(registers_t *regs) {
+    virtual_addr_t addr = regs->ebx;
+    size_t length = (regs->ecx + PAGE_SIZE - 1) & PTE_FRAME;
+    kuint32_t prot = regs->edx & (PROT_READ | PROT_WRITE | PROT_EXEC);
+    process_t* proc = sys_mem_process(addr, length);
+    if (!proc || !vmm_vma_protect(&proc->vmas, addr, length, prot)) {
+        regs->eax = (kuint32_t)-1;
+        return;
+    }
+
+    // Pages already present pick up the new rights, the rest get them when they are faulted in
+    vmm_vma_t protected_vma = { addr, addr + length, prot | VMA_USER, VMA_ANONYMOUS };
+    vmm_protect_range(proc->page_directory, addr, length / PAGE_SIZE, vmm_vma_pte_flags(&protected_vma));
+    regs->eax = 0;
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include <kernel/vmalloc.h>
+#include <kernel/log.h>
+#include <kernel/sync.h>
+#include <arch/i386/pmm.h>
+#include <arch/i386/vmm.h>
+
+// Reserved areas sorted by address, each one covers its guard page and its mapped pages
+static vmalloc_area_t areas[VMALLOC_MAX_AREAS];
+static kuint32_t area_count = 0;
+static kuint32_t mapped_pages = 0;
+
+static size_t vmalloc_area_span(const vmalloc_area_t* area) {
+    return VMALLOC_GUARD_SIZE + area->pages * PAGE_SIZE;
+}
+
+// Returns the index of the first area starting at or above an address
+static kuint32_t vmalloc_lower_bound(virtual_addr_t virtual_addr) {
+    kuint32_t low = 0, high = area_count;
+    while (low < high) {
+        kuint32_t mid = (low + high) / 2;
+        if (areas[mid].base < virtual_addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Reserves address space for an area with first fit and returns its slot, or -1 when the region is full
+static kint32_t vmalloc_reserve(kuint32_t pages) {
+    if (area_count == VMALLOC_MAX_AREAS) {
+        return -1;
+    }
+
+    size_t span = VMALLOC_GUARD_SIZE + pages * PAGE_SIZE;
+    virtual_addr_t cursor = VMALLOC_VIRTUAL_START;
+    kuint32_t index = 0;
+    for (; index < area_count; index++) {
+        if (areas[index].base - cursor >= span) {
+            break;
+        }
+        cursor = areas[index].base + vmalloc_area_span(&areas[index]);
+    }
+    if (index == area_count && VMALLOC_VIRTUAL_END - cursor < span) {
+        return -1;
+    }
+
+    for (kuint32_t i = area_count; i > index; i--) {
+        areas[i] = areas[i - 1];
+    }
+    areas[index].base = cursor;
+    areas[index].pages = pages;
+    area_count++;
+    return index;
+}
+
+static void vmalloc_release(kuint32_t index) {
+    for (kuint32_t i = index; i + 1 < area_count; i++) {
+        areas[i] = areas[i + 1];
+    }
+    area_count--;
+}
+
+generic_ptr vmalloc(size_t size) {
+    if (size == 0 || size > VMALLOC_VIRTUAL_END - VMALLOC_VIRTUAL_START) {
+        return NULL;
+    }
+    kuint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    kuint32_t flags = interrupts_save();
+    kint32_t index = vmalloc_reserve(pages);
+    if (index < 0) {
+        interrupts_restore(flags);
+        LOG_ERR("VMALLOC Error: No room for %d pages", pages);
+        return NULL;
+    }
+    virtual_addr_t start = areas[index].base + VMALLOC_GUARD_SIZE;
+
+    // The frames don't have to be contiguous, they are mapped a batch at a time. The kernel half tables are
+    // shared, so the area is visible in every address space right away.
+    pde_t* dir = vmm_get_kernel_directory();
+    kuint32_t frames[VMALLOC_MAP_BATCH];
+    for (kuint32_t done = 0; done < pages;) {
+        kuint32_t batch = 0;
+        while (batch < VMALLOC_MAP_BATCH && done + batch < pages) {
+            kuint32_t frame = pmm_alloc_frame(PMM_ZONE_HIGH64);
+            if (frame == PMM_NO_FRAME) {
+                break;
+            }
+            pmm_frame_page(frame)->flags |= PMM_PAGE_KERNEL;
+            frames[batch++] = frame;
+        }
+
+        if (batch == 0 || !vmm_map_frames(dir, start + done * PAGE_SIZE, frames, batch, PTE_PRESENT | PTE_READ_WRITE | PTE_NO_EXECUTE)) {
+            // A failed batch may be partly mapped, its frames aren't accounted for by the range below
+            vmm_unmap_range(dir, start + done * PAGE_SIZE, batch);
+            for (kuint32_t i = 0; i < batch; i++) {
+                pmm_free_frame(frames[i]);
+            }
+            vmm_free_range(dir, start, done);
+            vmalloc_release(index);
+            interrupts_restore(flags);
+            LOG_ERR("VMALLOC Error: Out of memory mapping %d pages", pages);
+            return NULL;
+        }
+        done += batch;
+    }
+
+    mapped_pages += pages;
+    interrupts_restore(flags);
+    return (generic_ptr)start;
+}
+
+void vfree(generic_ptr ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    kuint32_t flags = interrupts_save();
+    virtual_addr_t base = (virtual_addr_t)ptr - VMALLOC_GUARD_SIZE;
+    kuint32_t index = vmalloc_lower_bound(base);
+    if (index == area_count || areas[index].base != base) {
+        interrupts_restore(flags);
+        LOG_ERR("VMALLOC Error: vfree of 0x%x, which vmalloc didn't hand out!", ptr);
+        return;
+    }
+
+    kuint32_t pages = areas[index].pages;
+    vmm_free_range(vmm_get_kernel_directory(), (virtual_addr_t)ptr, pages);
+    mapped_pages -= pages;
+    vmalloc_release(index);
+    interrupts_restore(flags);
+}
+
+bool vmalloc_is_guard_page(virtual_addr_t virtual_addr) {
+    if (virtual_addr < VMALLOC_VIRTUAL_START || virtual_addr >= VMALLOC_VIRTUAL_END) {
+        return false;
+    }
+
+    // The area whose guard page holds the address is the last one starting at or below it
+    kuint32_t index = vmalloc_lower_bound(virtual_addr + 1);
+    return index > 0 && virtual_addr - areas[index - 1].base < VMALLOC_GUARD_SIZE;
+}
+
+void vmalloc_get_stats(vmalloc_stats_t* stats) {
+    kuint32_t flags = interrupts_save();
+    size_t reserved = 0;
+    for (kuint32_t i = 0; i < area_count; i++) {
+        reserved += vmalloc_area_span(&areas[i]);
+    }
+    stats->areas = area_count;
+    stats->mapped_pages = mapped_pages;
+    stats->free_size = (VMALLOC_VIRTUAL_END - VMALLOC_VIRTUAL_START) - reserved;
+    interrupts_restore(flags);
+}
@@ -11,6 +11,13 @@ void proc_exit(int status) {
     asm volatile("int $0x80" : : "a" (SYSCALL_PROC_EXIT), "b" (status));
 }
 
+kint32_t proc_fork() {
+    // Returns the child's PID in the parent and 0 in the child
+    kint32_t pid;
+    asm volatile("int $0x80" : "=a" (pid) : "a" (SYSCALL_PROC_FORK));
+    return pid;
+}
+
 kuint32_t proc_pid() {
     kuint32_t pid;
     asm volatile("int $0x80" : "=a" (pid) : "a" (SYSCALL_PROC_PID));
@@ -21,4 +28,22 @@ kint32_t vfs_write(kuint32_t fd, const char* buf, size_t count) {
     int bytes_written;
     asm volatile("int $0x80" :  "=a" (bytes_written) : "a" (SYSCALL_VFS_WRITE), "b" (fd), "c" (buf), "d"(count));
     return bytes_written;
+}
+
+generic_ptr mmap(generic_ptr addr, size_t length, kuint32_t prot, kuint32_t flags) {
+    generic_ptr result;
+    asm volatile("int $0x80" : "=a" (result) : "a" (SYSCALL_MEM_MMAP), "b" (addr), "c" (length), "d" (prot), "S" (flags));
+    return result;
+}
+
+kint32_t munmap(generic_ptr addr, size_t length) {
+    kint32_t result;
+    asm volatile("int $0x80" : "=a" (result) : "a" (SYSCALL_MEM_MUNMAP), "b" (addr), "c" (length));
+    return result;
+}
+
+kint32_t mprotect(generic_ptr addr, size_t length, kuint32_t prot) {
+    kint32_t result;
+    asm volatile("int $0x80" : "=a" (result) : "a" (SYSCALL_MEM_MPROTECT), "b" (addr), "c" (length), "d" (prot));
+    return result;
 }
\ No newline at end of file